@@ -284,6 +284,17 @@ class RtMidiIn : public RtMidi
   //! Returns true if a port is open and false if not.
   virtual bool isPortOpen() const;
 
+  //! Driver time of the message being passed to the callback.
+  /*!
+      Only meaningful inside the callback.  The time is in seconds on the
+      getQueueTime() clock (the ALSA input queue), and is negative for APIs
+      that do not timestamp input.
+  */
+  double getEventTime( void );
+
+  //! Current time of the clock used by getEventTime(), in seconds.
+  double getQueueTime( void );
+
   //! Return the number of available MIDI input ports.
   /*!
     \return This function returns the number of MIDI ports of the selected API.
@@ -408,6 +419,42 @@ class RtMidiOut : public RtMidi
   */
   void sendMessage( std::vector<unsigned char> *message );
 
+  //! Immediately send a single message from a caller-owned buffer.
+  /*!
+      Same as above, but avoids building a std::vector for each message.
+  */
+  void sendMessage( const unsigned char *message, size_t size );
+
+  //! Buffer a message for output, it is sent by the next flushMessages().
+  /*!
+      Lets several messages share one driver round trip.  APIs without
+      output buffering send immediately.
+  */
+  void bufferMessage( const unsigned char *message, size_t size );
+
+  //! Send all messages buffered with bufferMessage() or bufferMessageAt().
+  void flushMessages( void );
+
+  //! Start a sequencer queue for scheduled output (ALSA only).
+  /*!
+      Returns false if the current API cannot schedule messages, in which
+      case sendMessageAt() sends immediately.  Queue time starts at zero.
+  */
+  bool startQueue( void );
+
+  //! Return the current time of the output queue in seconds (ALSA only).
+  double getQueueTime( void );
+
+  //! Schedule a message for delivery at the given queue time in seconds.
+  /*!
+      The driver holds the message and delivers it at queueTime.  Without
+      a running queue the message is sent immediately.
+  */
+  void sendMessageAt( double queueTime, const unsigned char *message, size_t size );
+
+  //! Buffer a scheduled message, it is sent by the next flushMessages().
+  void bufferMessageAt( double queueTime, const unsigned char *message, size_t size );
+
   //! Set an error callback function to be invoked when an error has occured.
   /*!
     The callback function will be called whenever an error has occured. It is best
@@ -472,6 +519,8 @@ class MidiInApi : public MidiApi
   void cancelCallback( void );
   virtual void ignoreTypes( bool midiSysex, bool midiTime, bool midiSense );
   double getMessage( std::vector<unsigned char> *message );
+  double getEventTime( void ) { return inputData_.eventTime; }
+  virtual double getQueueTime( void ) { return 0.0; }
 
   // A MIDI structure used internally by the class to store incoming
   // messages.  Each message represents one and only one MIDI message.
@@ -509,12 +558,14 @@ class MidiInApi : public MidiApi
     RtMidiIn::RtMidiCallback userCallback;
     void *userData;
     bool continueSysex;
+    // Driver time of the message being delivered, negative if not available.
+    double eventTime;
 
     // Default constructor.
   RtMidiInData()
   : ignoreFlags(7), doInput(false), firstMessage(true),
       apiData(0), usingCallback(false), userCallback(0), userData(0),
-      continueSysex(false) {}
+      continueSysex(false), eventTime(-1.0) {}
   };
 
  protected:
@@ -527,7 +578,17 @@ class MidiOutApi : public MidiApi
 
   MidiOutApi( void );
   virtual ~MidiOutApi( void );
-  virtual void sendMessage( std::vector<unsigned char> *message ) = 0;
+  virtual void sendMessage( const unsigned char *message, size_t size ) = 0;
+
+  // Scheduled output, APIs without a sequencer queue send immediately.
+  virtual bool startQueue( void ) { return false; }
+  virtual double getQueueTime( void ) { return 0.0; }
+  virtual void sendMessageAt( double /*queueTime*/, const unsigned char *message, size_t size ) { sendMessage( message, size ); }
+
+  // Buffered output, APIs without an output buffer send immediately.
+  virtual void bufferMessage( const unsigned char *message, size_t size ) { sendMessage( message, size ); }
+  virtual void bufferMessageAt( double queueTime, const unsigned char *message, size_t size ) { sendMessageAt( queueTime, message, size ); }
+  virtual void flushMessages( void ) { }
 };
 
 // **************************************************************** //
@@ -547,6 +608,8 @@ inline unsigned int RtMidiIn :: getPortCount( void ) { return rtapi_->getPortCou
 inline std::string RtMidiIn :: getPortName( unsigned int portNumber ) { return rtapi_->getPortName( portNumber ); }
 inline void RtMidiIn :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense ) { ((MidiInApi *)rtapi_)->ignoreTypes( midiSysex, midiTime, midiSense ); }
 inline double RtMidiIn :: getMessage( std::vector<unsigned char> *message ) { return ((MidiInApi *)rtapi_)->getMessage( message ); }
+inline double RtMidiIn :: getEventTime( void ) { return ((MidiInApi *)rtapi_)->getEventTime(); }
+inline double RtMidiIn :: getQueueTime( void ) { return ((MidiInApi *)rtapi_)->getQueueTime(); }
 inline void RtMidiIn :: setErrorCallback( RtMidiErrorCallback errorCallback ) { rtapi_->setErrorCallback(errorCallback); }
 
 inline RtMidi::Api RtMidiOut :: getCurrentApi( void ) throw() { return rtapi_->getCurrentApi(); }
@@ -556,7 +619,14 @@ inline void RtMidiOut :: closePort( void ) { rtapi_->closePort(); }
 inline bool RtMidiOut :: isPortOpen() const { return rtapi_->isPortOpen(); }
 inline unsigned int RtMidiOut :: getPortCount( void ) { return rtapi_->getPortCount(); }
 inline std::string RtMidiOut :: getPortName( unsigned int portNumber ) { return rtapi_->getPortName( portNumber ); }
-inline void RtMidiOut :: sendMessage( std::vector<unsigned char> *message ) { ((MidiOutApi *)rtapi_)->sendMessage( message ); }
+inline void RtMidiOut :: sendMessage( std::vector<unsigned char> *message ) { ((MidiOutApi *)rtapi_)->sendMessage( message->empty() ? NULL : &(*message)[0], message->size() ); }
+inline void RtMidiOut :: sendMessage( const unsigned char *message, size_t size ) { ((MidiOutApi *)rtapi_)->sendMessage( message, size ); }
+inline bool RtMidiOut :: startQueue( void ) { return ((MidiOutApi *)rtapi_)->startQueue(); }
+inline double RtMidiOut :: getQueueTime( void ) { return ((MidiOutApi *)rtapi_)->getQueueTime(); }
+inline void RtMidiOut :: sendMessageAt( double queueTime, const unsigned char *message, size_t size ) { ((MidiOutApi *)rtapi_)->sendMessageAt( queueTime, message, size ); }
+inline void RtMidiOut :: bufferMessage( const unsigned char *message, size_t size ) { ((MidiOutApi *)rtapi_)->bufferMessage( message, size ); }
+inline void RtMidiOut :: bufferMessageAt( double queueTime, const unsigned char *message, size_t size ) { ((MidiOutApi *)rtapi_)->bufferMessageAt( queueTime, message, size ); }
+inline void RtMidiOut :: flushMessages( void ) { ((MidiOutApi *)rtapi_)->flushMessages(); }
 inline void RtMidiOut :: setErrorCallback( RtMidiErrorCallback errorCallback ) { rtapi_->setErrorCallback(errorCallback); }
 
 // **************************************************************** //
@@ -598,7 +668,7 @@ class MidiOutCore: public MidiOutApi
   void closePort( void );
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
-  void sendMessage( std::vector<unsigned char> *message );
+  void sendMessage( const unsigned char *message, size_t size );
 
  protected:
   void initialize( const std::string& clientName );
@@ -638,7 +708,7 @@ class MidiOutJack: public MidiOutApi
   void closePort( void );
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
-  void sendMessage( std::vector<unsigned char> *message );
+  void sendMessage( const unsigned char *message, size_t size );
 
  protected:
   std::string clientName;
@@ -662,6 +732,7 @@ class MidiInAlsa: public MidiInApi
   void closePort( void );
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
+  double getQueueTime( void );
 
  protected:
   void initialize( const std::string& clientName );
@@ -678,10 +749,19 @@ class MidiOutAlsa: public MidiOutApi
   void closePort( void );
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
-  void sendMessage( std::vector<unsigned char> *message );
+  void sendMessage( const unsigned char *message, size_t size );
+  bool startQueue( void );
+  double getQueueTime( void );
+  void sendMessageAt( double queueTime, const unsigned char *message, size_t size );
+  void bufferMessage( const unsigned char *message, size_t size );
+  void bufferMessageAt( double queueTime, const unsigned char *message, size_t size );
+  void flushMessages( void );
 
  protected:
   void initialize( const std::string& clientName );
+  // Direct output when queueTime < 0, otherwise scheduled on the output queue.
+  // Without drain the event stays in the client buffer until flushMessages().
+  void outputMessage( const unsigned char *message, size_t size, double queueTime, bool drain );
 };
 
 #endif
@@ -715,7 +795,7 @@ class MidiOutWinMM: public MidiOutApi
   void closePort( void );
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
-  void sendMessage( std::vector<unsigned char> *message );
+  void sendMessage( const unsigned char *message, size_t size );
 
  protected:
   void initialize( const std::string& clientName );
@@ -750,7 +830,7 @@ class MidiOutDummy: public MidiOutApi
   void closePort( void ) {}
   unsigned int getPortCount( void ) { return 0; }
   std::string getPortName( unsigned int /*portNumber*/ ) { return ""; }
-  void sendMessage( std::vector<unsigned char> * /*message*/ ) {}
+  void sendMessage( const unsigned char * /*message*/, size_t /*size*/ ) {}
 
  protected:
   void initialize( const std::string& /*clientName*/ ) {}
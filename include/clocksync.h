@@ -0,0 +1,120 @@
+#ifndef PianoConnect_clocksync_h
+#define PianoConnect_clocksync_h
+
+#include <deque>
+#include <string>
+#include <cstddef>
+
+// Model of the peer's clock relative to ours.
+
+namespace PianoConnect {
+
+    // Fits remote - local = offset + skew * (local - t0) by weighted least
+    // squares over the clock sync samples of the last few minutes. Samples
+    // are weighted by 1 / rtt^2, since the error of one sample is bounded by
+    // half its round trip.
+    //
+    // Rounds first pass an NTP style clock filter: of the last eight rounds
+    // only the one with the lowest round trip is used, as queued paths add
+    // delay and asymmetry. The spread of the other offsets around it gives
+    // the dispersion. At most one round per 50ms is fitted, so dense
+    // piggybacked rounds don't shorten the window.
+    class ClockModel {
+    public:
+
+        ClockModel(double window = 300.0, std::size_t max_samples = 2048);
+
+        // One sync round: our send and receive times, the peer's reply time.
+        void feed(double local_sent, double remote, double local_received);
+        // A round where the peer held the message: received at remote_received,
+        // answered at remote_sent.
+        void feed(double local_sent, double remote_received, double remote_sent, double local_received);
+
+        // Start from an earlier skew estimate, e.g. from the sync cache. It
+        // is kept until the samples span long enough to fit one. The offset
+        // always comes from this session's rounds.
+        void seed(double skew);
+
+        bool valid() const;
+
+        // remote - local at local time 't'.
+        double offsetAt(double t) const;
+        // Estimated drift of the remote clock, seconds per second.
+        double skew() const;
+        // Confidence of the offset, in seconds: the clock filter's
+        // dispersion plus half the round trip of the sample it picked.
+        double dispersion() const;
+
+        // Map a remote timestamp into our clock.
+        double toLocal(double remote) const;
+
+    private:
+
+        struct Sample {
+            double local, offset, weight;
+        };
+
+        struct FilterSample {
+            double local, offset, rtt;
+        };
+
+        static const int FILTER_SIZE = 8;
+
+        void fit();
+
+        FilterSample filter[FILTER_SIZE];
+        int filter_count, filter_next;
+        double last_used, filter_dispersion;
+
+        std::deque<Sample> samples;
+        double window;
+        std::size_t max_samples;
+
+        // offset(t) = mean_offset + slope * (t - mean_local)
+        double mean_local, mean_offset, slope;
+        double prior_skew;
+    };
+
+    // Spreads offset corrections over time, as adjtime() does, so a new
+    // clock estimate doesn't shift all following notes at once. The error
+    // left to apply decays with a time constant of 'window' seconds, never
+    // faster than 'max_slope' seconds per second; errors beyond
+    // 'step_threshold' are applied at once.
+    class OffsetSlew {
+    public:
+
+        OffsetSlew(double window = 1.0, double max_slope = 1e-3, double step_threshold = 0.05);
+
+        void setWindow(double window);
+
+        // The estimated offset moved by 'amount' at time 't'.
+        void correct(double t, double amount);
+
+        // Correction not yet applied at time 't', add it to the estimated offset.
+        double residual(double t);
+        // As of the last call, for reporting.
+        double residual() const;
+
+    private:
+
+        void advance(double t);
+
+        double window, max_slope, step_threshold;
+        double error, last_time;
+    };
+
+    // Last known calibration of a peer, kept across sessions. Both clocks
+    // count from boot, so the offset is no good after either side reboots
+    // and is not kept; the drift and the network path are.
+    struct SyncCalibration {
+        double skew, latency;
+    };
+
+    // The cache is a text file with one "<peer> <skew> <latency>" line per
+    // peer; peer names must not contain spaces.
+    bool loadSyncCache(const std::string& file, const std::string& peer, SyncCalibration& calibration);
+    void saveSyncCache(const std::string& file, const std::string& peer, const SyncCalibration& calibration);
+
+}
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef PianoConnect_dispatch_h
+#define PianoConnect_dispatch_h
+
+#include "midi.h"
+#include "protocol.h"
+#include "lockfree.h"
+
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+
+// Output side of the playback path.
+
+namespace PianoConnect {
+
+    // Accumulated durations of one phase of the playback loop.
+    struct PhaseStatistics {
+        int count;
+        double total, maximum;
+
+        PhaseStatistics() {
+            reset();
+        }
+
+        void feed(double duration) {
+            if(count == 0 || duration > maximum) maximum = duration;
+            count += 1;
+            total += duration;
+        }
+
+        void merge(const PhaseStatistics& other) {
+            if(other.count == 0) return;
+            if(count == 0 || other.maximum > maximum) maximum = other.maximum;
+            count += other.count;
+            total += other.total;
+        }
+
+        double average() const {
+            return count > 0 ? total / count : 0;
+        }
+
+        void reset() {
+            count = 0;
+            total = 0;
+            maximum = 0;
+        }
+    };
+
+    // Counters of one output device, see OutputDispatcher::statistics().
+    struct OutputStatistics {
+        unsigned int depth, max_depth;
+        int dropped;
+        // Send time minus the message timestamp, for scheduled output this
+        // is the hand-off to the driver and normally negative.
+        PhaseStatistics lateness;
+    };
+
+    // Owns a worker thread that feeds one output device from its own queue,
+    // so a slow or blocked port does not hold up the others.
+    class OutputDispatcher {
+    public:
+
+        struct ThreadInfo {
+            OutputDispatcher* self;
+            void operator() () {
+                self->worker_thread();
+            }
+        };
+
+        // With 'scheduled', messages are handed to the driver with their
+        // playout time as soon as they are posted, see MIDIDevice::sendMessageAt.
+        OutputDispatcher(boost::shared_ptr<MIDIDevice> device, bool scheduled);
+        ~OutputDispatcher();
+
+        bool isScheduled() const {
+            return scheduled;
+        }
+
+        // Playback thread only, never blocks.
+        void post(const MIDIMessage& message);
+
+        // Snapshot the counters, resets maximum depth and lateness.
+        OutputStatistics statistics();
+
+        void worker_thread();
+
+    private:
+
+        boost::shared_ptr<MIDIDevice> device;
+        bool scheduled;
+
+        SPSCQueue<MIDIMessage, 256> queue;
+        boost::atomic<bool> waiting;
+        boost::atomic<unsigned int> max_depth;
+        boost::atomic<int> dropped;
+        bool should_stop;
+
+        // Guards should_stop, the sleep on condition and lateness.
+        boost::mutex mutex;
+        boost::condition_variable condition;
+        PhaseStatistics lateness;
+
+        boost::thread thread;
+    };
+
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef PianoConnect_fec_h
+#define PianoConnect_fec_h
+
+#include "protocol.h"
+#include "timer.h"
+
+#include <boost/thread.hpp>
+
+// Forward error correction: XOR parity over small groups of MIDI packets.
+
+namespace PianoConnect {
+
+    const int FEC_MAX_GROUP = 16;
+
+    // Sender side. Sent packets are XORed into the open group, which closes
+    // after 'group_size' packets, or once it is 'window' seconds old so a
+    // lost note isn't rebuilt long after it was due.
+    class ParityEncoder {
+    public:
+
+        ParityEncoder(int group_size = 4, double window = 0.01);
+
+        void setGroupSize(int group_size);
+
+        // A packet was sent at 'now'. True when this closes the group,
+        // with its parity in 'parity'.
+        bool add(double now, const Packet_MIDIMessage& packet, Packet_Parity& parity);
+
+        // Close the open group if it is older than the window.
+        bool flush(double now, Packet_Parity& parity);
+
+        // When the open group is due, DEADLINE_NONE if none is open.
+        double deadline();
+
+        int numParity();
+
+    private:
+
+        void close(Packet_Parity& parity);
+
+        int group_size;
+        double window;
+
+        Packet_Parity group;
+        double group_started;
+        int num_parity;
+
+        boost::mutex mutex;
+    };
+
+    // Receiver side, owned by the network thread. Remembers the last
+    // packets received and rebuilds a group's one missing packet.
+    class ParityDecoder {
+    public:
+
+        ParityDecoder();
+
+        void received(const Packet_MIDIMessage& packet);
+        // A packet played from a journal. It counts as received, but its
+        // timestamp may be a microsecond off and it rebuilds nothing.
+        void repaired(const Packet_MIDIMessage& packet);
+
+        // True with the missing packet in 'recovered' if exactly one of the
+        // group never arrived.
+        bool recover(const Packet_Parity& parity, Packet_MIDIMessage& recovered);
+
+        int numRecovered() const { return num_recovered; }
+        // Groups that lost more than one packet.
+        int numUnrecoverable() const { return num_unrecoverable; }
+
+    private:
+
+        static const int HISTORY = 256;
+
+        struct Entry {
+            bool valid, exact;
+            Packet_MIDIMessage packet;
+        };
+
+        const Entry* find(unsigned int session, unsigned int serial) const;
+
+        Entry history[HISTORY];
+        int num_recovered, num_unrecoverable;
+    };
+
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef PianoConnect_jitterbuffer_h
+#define PianoConnect_jitterbuffer_h
+
+#include "dispatch.h"
+#include "statistics.h"
+
+#include <boost/thread.hpp>
+
+// Adaptive playout delay for messages from the network.
+
+namespace PianoConnect {
+
+    // Counters since the last call to JitterBuffer::statistics().
+    struct JitterStatistics {
+        double target, delay;
+        int arrivals;
+        // Arrival time minus playout time of messages that came in too late.
+        PhaseStatistics late;
+    };
+
+    // Picks the playout delay from a high percentile of the one-way delays
+    // seen over a sliding window, plus a safety margin. The delay follows
+    // the target up at once, and down slowly and smoothly so the playout
+    // never audibly jumps.
+    class JitterBuffer {
+    public:
+
+        JitterBuffer(double percentile = 0.99, double margin = 0.002);
+
+        // One-way delay sample: local receive time minus the sender's timestamp
+        // in local time. Samples above the current delay raise it right away.
+        void feed(double delay);
+
+        // Start from an earlier delay, e.g. from the sync cache.
+        void seed(double delay);
+
+        // Recompute the target and move the delay towards it.
+        void update(double now);
+
+        // A message due at 'playout' arrived at 'arrival'.
+        void arrived(double arrival, double playout);
+
+        double delay();
+        JitterStatistics statistics();
+
+    private:
+
+        void updateLocked(double now);
+
+        double percentile, margin;
+        RunningStatistics<256> window;
+
+        double target_delay, current_delay, last_update;
+
+        int arrivals;
+        PhaseStatistics late;
+
+        boost::mutex mutex;
+    };
+
+}
+
+#endif
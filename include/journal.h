@@ -0,0 +1,46 @@
+#ifndef PianoConnect_journal_h
+#define PianoConnect_journal_h
+
+#include "protocol.h"
+
+// Recovery journal: recent messages repeated on every outgoing packet.
+
+namespace PianoConnect {
+
+    // Sender side, the last 'size' channel messages sent. Not thread safe,
+    // the sender holds its send lock, like for the serial counter.
+    class RecoveryJournal {
+    public:
+
+        RecoveryJournal(int size = 4);
+
+        void setSize(int size);
+
+        // Entries for a packet sent at 'timestamp', oldest first. Returns
+        // the number written, at most JOURNAL_MAX_SIZE.
+        int write(double timestamp, JournalEntry* entries) const;
+
+        // Record a message after it was sent; other than 1-3 byte channel
+        // messages are left out.
+        void add(unsigned int serial, double timestamp, const unsigned char* message, int length);
+
+    private:
+
+        struct Item {
+            unsigned int serial;
+            double timestamp;
+            int length;
+            unsigned char message[3];
+        };
+
+        int size, count, next;
+        Item items[JOURNAL_MAX_SIZE];
+    };
+
+    // Whether a journal entry is still worth playing: anything that ends or
+    // changes state is, a note-on only if it is at most 'max_note_age' old.
+    bool journalRecoverable(const JournalEntry& entry, double max_note_age);
+
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef PianoConnect_lockfree_h
+#define PianoConnect_lockfree_h
+
+#include <cstring>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+
+// Lock-free structures shared between threads.
+
+namespace PianoConnect {
+
+    const int CACHE_LINE_SIZE = 64;
+
+    // Bounded multi-producer/single-consumer ring of fixed-size slots.
+    // Each slot carries a sequence number telling whether it is free for the
+    // producer that claimed it or ready for the consumer (D. Vyukov's scheme).
+    // Capacity must be a power of two; push() fails rather than blocks when full.
+    template < typename T, unsigned int Capacity >
+    class MPSCQueue {
+    public:
+
+        MPSCQueue() {
+            for(unsigned int i = 0; i < Capacity; i++) {
+                slots[i].sequence.store(i, boost::memory_order_relaxed);
+            }
+            head.store(0, boost::memory_order_relaxed);
+            tail = 0;
+        }
+
+        // Any thread.
+        bool push(const T& value) {
+            unsigned int position = head.load(boost::memory_order_relaxed);
+            for(;;) {
+                Slot& slot = slots[position & (Capacity - 1)];
+                unsigned int sequence = slot.sequence.load(boost::memory_order_acquire);
+                int diff = (int)(sequence - position);
+                if(diff == 0) {
+                    if(head.compare_exchange_weak(position, position + 1, boost::memory_order_relaxed)) {
+                        slot.value = value;
+                        slot.sequence.store(position + 1, boost::memory_order_release);
+                        return true;
+                    }
+                } else if(diff < 0) {
+                    return false;
+                } else {
+                    position = head.load(boost::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Consumer thread only.
+        bool pop(T& value) {
+            Slot& slot = slots[tail & (Capacity - 1)];
+            unsigned int sequence = slot.sequence.load(boost::memory_order_acquire);
+            if((int)(sequence - (tail + 1)) < 0) return false;
+            value = slot.value;
+            slot.sequence.store(tail + Capacity, boost::memory_order_release);
+            tail += 1;
+            return true;
+        }
+
+    private:
+
+        struct Slot {
+            boost::atomic<unsigned int> sequence;
+            T value;
+        };
+
+        Slot slots[Capacity];
+        char padding0[CACHE_LINE_SIZE];
+        boost::atomic<unsigned int> head;
+        char padding1[CACHE_LINE_SIZE];
+        unsigned int tail;
+    };
+
+    // Bounded single-producer/single-consumer ring.
+    // Capacity must be a power of two; push() fails rather than blocks when full.
+    template < typename T, unsigned int Capacity >
+    class SPSCQueue {
+    public:
+
+        SPSCQueue() {
+            head.store(0, boost::memory_order_relaxed);
+            tail.store(0, boost::memory_order_relaxed);
+        }
+
+        // Producer thread only.
+        bool push(const T& value) {
+            unsigned int position = head.load(boost::memory_order_relaxed);
+            if(position - tail.load(boost::memory_order_acquire) >= Capacity) return false;
+            slots[position & (Capacity - 1)] = value;
+            head.store(position + 1, boost::memory_order_release);
+            return true;
+        }
+
+        // Consumer thread only.
+        bool pop(T& value) {
+            unsigned int position = tail.load(boost::memory_order_relaxed);
+            if(position == head.load(boost::memory_order_acquire)) return false;
+            value = slots[position & (Capacity - 1)];
+            tail.store(position + 1, boost::memory_order_release);
+            return true;
+        }
+
+        // Any thread, approximate while the other side is active.
+        unsigned int size() const {
+            return head.load(boost::memory_order_acquire) - tail.load(boost::memory_order_acquire);
+        }
+
+        bool empty() const {
+            return size() == 0;
+        }
+
+    private:
+
+        T slots[Capacity];
+        char padding0[CACHE_LINE_SIZE];
+        boost::atomic<unsigned int> head;
+        char padding1[CACHE_LINE_SIZE];
+        boost::atomic<unsigned int> tail;
+    };
+
+    // Single-writer value published with a sequence lock: readers never
+    // block the writer and retry until they copy a consistent version.
+    // T must be plain data; it is stored in atomic words so concurrent
+    // reads are well defined.
+    template < typename T >
+    class SeqLock {
+    public:
+
+        SeqLock() {
+            sequence.store(0, boost::memory_order_relaxed);
+            for(int i = 0; i < WORDS; i++) words[i].store(0, boost::memory_order_relaxed);
+        }
+
+        // Writer thread only.
+        void write(const T& value) {
+            boost::uint64_t buffer[WORDS];
+            std::memset(buffer, 0, sizeof(buffer));
+            std::memcpy(buffer, &value, sizeof(T));
+            unsigned int s = sequence.load(boost::memory_order_relaxed);
+            // Odd while the words are being updated.
+            sequence.store(s + 1, boost::memory_order_relaxed);
+            boost::atomic_thread_fence(boost::memory_order_release);
+            for(int i = 0; i < WORDS; i++) words[i].store(buffer[i], boost::memory_order_relaxed);
+            sequence.store(s + 2, boost::memory_order_release);
+        }
+
+        // Any thread.
+        T read() const {
+            boost::uint64_t buffer[WORDS];
+            unsigned int before, after;
+            do {
+                before = sequence.load(boost::memory_order_acquire);
+                for(int i = 0; i < WORDS; i++) buffer[i] = words[i].load(boost::memory_order_relaxed);
+                boost::atomic_thread_fence(boost::memory_order_acquire);
+                after = sequence.load(boost::memory_order_relaxed);
+            } while((before & 1) || before != after);
+            T value;
+            std::memcpy(&value, buffer, sizeof(T));
+            return value;
+        }
+
+        // Number of writes so far.
+        unsigned int version() const {
+            return sequence.load(boost::memory_order_acquire) / 2;
+        }
+
+    private:
+
+        static const int WORDS = (sizeof(T) + 7) / 8;
+
+        boost::atomic<unsigned int> sequence;
+        boost::atomic<boost::uint64_t> words[WORDS];
+    };
+
+}
+
+#endif
@@ -13,6 +13,8 @@ namespace PianoConnect {
 
         class Delegate {
         public:
+            // timestamp: when the message arrived, in precise_time() seconds,
+            // taken from the driver's event time where available.
             virtual void onMessage(double timestamp, const void* message, int length) = 0;
             virtual ~Delegate() { }
         };
@@ -20,6 +22,25 @@ namespace PianoConnect {
         virtual void sendMessage(const void* message, int length) = 0;
         virtual void setDelegate(Delegate* delegate) = 0;
 
+        // Hardware-timed output: let the driver deliver messages at their
+        // playout time. Returns false if the backend can't schedule.
+        virtual bool enableScheduling() { return false; }
+        // Deliver at a precise_time() time, or right away without scheduling.
+        virtual void sendMessageAt(double, const void* message, int length) {
+            sendMessage(message, length);
+        }
+
+        // Batched output: messages appended between beginBatch() and
+        // flushBatch() reach the driver in one go where the backend allows.
+        virtual void beginBatch() { }
+        virtual void appendMessage(const void* message, int length) {
+            sendMessage(message, length);
+        }
+        virtual void appendMessageAt(double time, const void* message, int length) {
+            sendMessageAt(time, message, length);
+        }
+        virtual void flushBatch() { }
+
         virtual ~MIDIDevice() { }
     };
 
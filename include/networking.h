@@ -25,6 +25,12 @@ namespace PianoConnect {
         class Delegate {
         public:
             virtual void onPacket(const void* packet, int size) = 0;
+            // With the arrival time in precise_time() seconds. UDP connections
+            // take it from the kernel where supported, so time spent before the
+            // listen thread ran is not counted.
+            virtual void onPacketReceived(double, const void* packet, int size) {
+                onPacket(packet, size);
+            }
             virtual ~Delegate() { }
         };
 
@@ -5,12 +5,20 @@
 #include "midi.h"
 #include "protocol.h"
 #include "timer.h"
+#include "lockfree.h"
+#include "timingwheel.h"
+#include "dispatch.h"
+#include "jitterbuffer.h"
+#include "clocksync.h"
+#include "statistics.h"
+#include "replaywindow.h"
+#include "fec.h"
+#include "journal.h"
+#include "wire.h"
 
 #include <string>
 #include <vector>
 #include <deque>
-#include <set>
-#include <queue>
 
 #include <ostream>
 
@@ -41,6 +49,9 @@ namespace PianoConnect {
 
         std::string log_file;
 
+        // Per-peer clock calibration kept across sessions.
+        std::string sync_cache;
+
         std::string hmac_key;
 
         double latency;
@@ -48,39 +59,59 @@ namespace PianoConnect {
 
         bool input_ask, output_ask;
 
+        // Let drivers that support it schedule output at playout time.
+        bool scheduled_output;
+
         int duplication;
 
+        // XOR parity after every 'fec' MIDI packets, 0 = off.
+        int fec;
+
+        // Repeat the last 'journal' messages on every MIDI packet, 0 = off.
+        int journal;
+
+        // Bundle messages sent within this many seconds of each other, 0 = off.
+        double bundle_window;
+
+        // Carry clock sync echo fields on MIDI packets.
+        bool piggyback_sync;
+
+        // Clock corrections are spread over this many seconds.
+        double slew_window;
+
+        // Source for precise_time(), see timer.h.
+        ClockSource clock_source;
+
+        // Real-time mode: SCHED_FIFO priority (0 = off), per-thread CPU, mlockall.
+        int realtime_priority;
+        std::vector< std::pair<std::string, int> > cpu_affinity;
+        bool lock_memory;
+
         void read(const std::string& file);
     };
 
-    struct RunningStatistics {
-        std::deque<double> window;
-        int window_size;
-        double sum;
-
-        RunningStatistics() {
-            sum = 0;
-            window_size = 40;
-        }
-
-        void feed(double value) {
-            window.push_back(value);
-            sum += value;
-
-            if(window.size() > window_size) {
-                sum -= window.front();
-                window.pop_front();
-            }
-        }
-
-        double average() const {
-            return sum / window.size();
-        }
+    // Clock and latency estimates as of 'time', published together so
+    // readers never mix values from different sync rounds.
+    struct ClockSnapshot {
+        double time;
+        // Peer clock: other_time = my_time + offset, drifting by skew.
+        double offset, skew;
+        double dispersion, residual;
+        // Delay added to messages before playout.
+        double playout_delay;
+        // Average one-way network delay.
+        double network_latency;
+    };
+
+    // A datagram waiting in the outbox.
+    struct OutgoingDatagram {
+        int size, copies;
+        unsigned char data[WIRE_BUNDLE_MAX_SIZE];
     };
 
     class PianoConnectApplication : public MIDIDevice::Delegate,
                                     public NetworkConnection::Delegate,
-                                    public HighResolutionTimer::Delegate {
+                                    public DeadlineTimer::Delegate {
     public:
 
         PianoConnectApplication(int argc, char* argv[]);
@@ -91,7 +122,41 @@ namespace PianoConnect {
 
         virtual void onMessage(double timestamp, const void* message, int length);
         virtual void onPacket(const void* packet, int size);
-        virtual void onTimer();
+        virtual void onPacketReceived(double timestamp, const void* packet, int size);
+        virtual double onDeadline(double now);
+
+        // Decode a compact packet and handle it as the struct it stands for.
+        void onWirePacket(double now, const unsigned char* buffer, int size);
+        // Queue a datagram to go out 'copies' times, with send_mutex held.
+        // Returns the number queued, for sendQueued().
+        int queueDatagram(const unsigned char* datagram, int size, int copies);
+        // Queue parity after any held bundle, with send_mutex held.
+        int queueParity(double now, const Packet_Parity& parity);
+        // Send what was queued, once send_mutex is released. Never waits:
+        // if another thread is sending, it sends these too.
+        void sendQueued(int queued);
+
+        // A MIDI packet from the peer, or one rebuilt from parity.
+        // False if it was a duplicate.
+        bool onMIDIPacket(double now, Packet_MIDIMessage* packet, int size, bool recovered);
+        // Play the messages a journal packet repeats that never arrived,
+        // 'sent' is the packet's own sender timestamp.
+        void onJournal(double now, double sent, const Packet_MIDIMessageJournal* packet, int size);
+
+        // Hand a message to the playback thread, lock-free.
+        void enqueue(const MIDIMessage& message);
+
+        void sendClockSync();
+        // Rapid sync rounds, so the clock model converges in a few hundred ms.
+        void sendClockSyncBurst();
+        // Bookkeeping for each sync round, from a ping or a MIDI packet.
+        void onSyncRound(double now);
+        // Feed a sync round to the clock model, slewing the change in offset.
+        void feedClock(double now, double local_sent, double remote_received, double remote_sent, double local_received);
+        // Publish the current clock and latency estimates to other threads.
+        void publishClock(double now);
+        // Name of the peer in the sync cache.
+        std::string peerName() const;
 
         ~PianoConnectApplication();
 
@@ -100,21 +165,85 @@ namespace PianoConnect {
         boost::shared_ptr<MIDIManager> midi_manager;
         std::vector< boost::shared_ptr<MIDIDevice> > input_devices;
         std::vector< boost::shared_ptr<MIDIDevice> > output_devices;
+        // One per output device, fed by the playback thread.
+        std::vector< boost::shared_ptr<OutputDispatcher> > output_dispatchers;
+        bool has_scheduled_output;
 
         boost::shared_ptr<NetworkConnection> networking;
 
+        // Playback scheduler, sleeps until the earliest queued message is due.
+        boost::shared_ptr<DeadlineTimer> timer;
+
         int num_packets;
         int num_midi_messages;
 
-        // Window used to smooth timestmap deltas.
-        RunningStatistics delta_rs, latency_rs;
-        double delta, latency;
-
-        std::set<UniqueIdentifier> received_packets;
-        unsigned int current_serial;
-
-        std::priority_queue<MIDIMessage> message_queue;
+        // Window used to smooth round trip times.
+        RunningStatistics<40> latency_rs;
+
+        // Peer clock offset and drift, fed by clock sync rounds.
+        ClockModel clock_model;
+        // Playout follows clock model corrections gradually.
+        OffsetSlew offset_slew;
+        // Set by the network thread when the peer answers after a silence.
+        double last_sync_ack;
+        int num_sync_acks;
+        boost::atomic<bool> sync_burst;
+
+        // Last MIDI packet from the peer: its sender timestamp and our receive
+        // time, echoed back on the next message we send.
+        double echo_timestamp, echo_received;
+        boost::mutex echo_mutex;
+        // Sync rounds that came in on MIDI packets, lets the pings back off.
+        boost::atomic<int> num_echo_rounds;
+
+        // Playout delay for auto latency, fed with one-way delays.
+        JitterBuffer jitter;
+
+        // Written by the network thread only, read anywhere without a lock.
+        SeqLock<ClockSnapshot> clock_snapshot;
+
+        // Duplicates from packet duplication, owned by the network thread.
+        ReplayWindow<> received_packets;
+        // Session fixed at startup, serial advanced under send_mutex.
+        unsigned int current_session, current_serial;
+
+        WireDecoder wire_decoder;
+        // Set while the messages of a bundle are handled, network thread.
+        bool receiving_bundle;
+        // Packets dropped before the first sync round, network thread.
+        int num_unsynced;
+
+        ParityEncoder fec_encoder;
+        ParityDecoder fec_decoder;
+
+        // Shared by the MIDI input and playback threads.
+        MessageBundler bundler;
+        // Held while MIDI datagrams and parity are made and queued, so parity
+        // never overtakes the bundle holding messages it covers. Also guards
+        // the serial counter and journal against concurrent input devices.
+        // Nothing is sent with it held.
+        boost::mutex send_mutex;
+        // Datagrams in the order they were queued, and how many are not
+        // sent yet; the thread that takes the count from 0 sends them.
+        MPSCQueue<OutgoingDatagram, 64> outbox;
+        boost::atomic<int> num_outgoing;
+
+        RecoveryJournal journal;
+        // Messages played from the peer's journal, network thread.
+        int num_repaired;
+
+        // Messages from the MIDI and network threads, drained by the playback thread.
+        MPSCQueue<MIDIMessage, 1024> incoming_messages;
+        // Messages lost to a full queue, from either thread.
+        boost::atomic<int> num_dropped;
+
+        // Owned by the playback thread.
+        TimingWheel<MIDIMessage> message_queue;
+        std::vector<MIDIMessage> dispatch_batch;
+
+        // Guards log_messages and the phase statistics.
         std::deque<MIDIMessage> log_messages;
+        PhaseStatistics collect_phase, emit_phase, lock_phase;
         boost::mutex mutex;
 
         boost::shared_ptr<std::ostream> log_stream;
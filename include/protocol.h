@@ -8,8 +8,12 @@ namespace PianoConnect {
     const unsigned char PACKET_ClockSync        = 1;
     const unsigned char PACKET_ClockSyncAck     = 2;
     const unsigned char PACKET_MIDIMessage      = 100;
+    const unsigned char PACKET_MIDIMessageEcho  = 101;
+    const unsigned char PACKET_Parity           = 102;
+    const unsigned char PACKET_MIDIMessageJournal = 103;
 
     const int MIDI_MAX_MESSAGE_SIZE = 8;
+    const int JOURNAL_MAX_SIZE = 16;
 
     struct Packet {
         unsigned char type;
@@ -19,25 +23,22 @@ namespace PianoConnect {
         unsigned char type;
         double timestamp_sent;
         double timestamp_ack;
+        // When the peer received the ClockSync, timestamp_ack is when it answered.
+        double timestamp_received;
     };
 
     struct MIDIMessage {
         int length;
         double timestamp;
         unsigned char message[MIDI_MAX_MESSAGE_SIZE];
-
-        bool operator < (const MIDIMessage& msg) const {
-            return timestamp > msg.timestamp;
-        }
     };
 
+    // Serials count up from 0 in each session, a sender picks a new session
+    // (0-65535) from its start time every time it starts.
     struct UniqueIdentifier {
         unsigned int serial;
+        unsigned int session;
         double timestamp;
-        bool operator < (const UniqueIdentifier& rhs) const {
-            if(timestamp != rhs.timestamp) return timestamp < rhs.timestamp;
-            return serial < rhs.serial;
-        }
     };
 
     struct Packet_MIDIMessage {
@@ -45,6 +46,48 @@ namespace PianoConnect {
         MIDIMessage message;
         UniqueIdentifier identifier;
     };
+
+    // A MIDI message doubling as a clock sync round: echoes the sender
+    // timestamp of the last message received from the peer, and the time
+    // from its arrival here to this message's timestamp.
+    struct Packet_MIDIMessageEcho {
+        Packet_MIDIMessage data;
+        double echo_timestamp;
+        double echo_hold;
+    };
+
+    // A recently sent channel message, 'age' seconds older than the packet
+    // carrying it.
+    struct JournalEntry {
+        unsigned int serial;
+        float age;
+        unsigned char length;
+        unsigned char message[3];
+    };
+
+    // A MIDI message followed by the last few messages sent before it, so
+    // the receiver can repair a lost note-off or controller change. No echo
+    // if echo_timestamp is 0. Only the first 'count' entries are sent.
+    struct Packet_MIDIMessageJournal {
+        Packet_MIDIMessageEcho data;
+        unsigned int count;
+        JournalEntry entries[JOURNAL_MAX_SIZE];
+    };
+
+    // A MIDIMessage as parity is computed over it: length, message bytes
+    // zero padded, timestamp in microseconds (see wire.h).
+    const int MIDI_RECORD_SIZE = 1 + MIDI_MAX_MESSAGE_SIZE + 8;
+
+    // XOR of the records of 'count' consecutive MIDI packets from one
+    // session, starting at 'first_serial'. Any one of them can be rebuilt
+    // from the parity and the others.
+    struct Packet_Parity {
+        unsigned char type;
+        unsigned char count;
+        unsigned int session;
+        unsigned int first_serial;
+        unsigned char parity[MIDI_RECORD_SIZE];
+    };
 }
 
 #endif
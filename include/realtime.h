@@ -0,0 +1,32 @@
+#ifndef PianoConnect_realtime_h
+#define PianoConnect_realtime_h
+
+#include <string>
+
+// Real-time scheduling, CPU pinning and memory locking.
+
+namespace PianoConnect {
+
+    // Threads are known by name: "playback", "output", "network" and "midi-input".
+    // Several threads may share a name, e.g. one "output" thread per device.
+    bool isThreadName(const std::string& name);
+
+    // Policies are registered before the threads start.
+    // SCHED_FIFO priority, 0 leaves the thread on the normal scheduler.
+    void setRealtimePriority(int priority);
+    // Pin a thread to one CPU, -1 lets it run anywhere.
+    void setThreadAffinity(const std::string& name, int cpu);
+
+    // Called by a thread when it starts, applies the registered policy.
+    // Missing permissions only produce a warning, the thread runs normally.
+    void applyThreadPolicy(const std::string& name);
+
+    // Lock current and future pages in memory, false if not permitted.
+    bool lockMemory();
+
+    // Names of the threads that got real-time priority so far, or "none".
+    std::string realtimeThreads();
+
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef PianoConnect_replaywindow_h
+#define PianoConnect_replaywindow_h
+
+#include <boost/cstdint.hpp>
+
+// Duplicate detection over a sliding window of serial numbers.
+
+namespace PianoConnect {
+
+    // Anti-replay window as in IPsec/DTLS: a bitmap of the last Window
+    // serials below the highest one seen, per sender session. Serials older
+    // than the window are treated as duplicates. A few senders are tracked at
+    // once; a new session takes over the one heard from least recently.
+    // Constant memory, accept() is O(1) and never allocates.
+    template < int Window = 1024, int Senders = 4 >
+    class ReplayWindow {
+    public:
+
+        ReplayWindow() {
+            clock = 0;
+            for(int i = 0; i < Senders; i++) {
+                senders[i].used = false;
+                senders[i].last_used = 0;
+            }
+        }
+
+        // True the first time a (session, serial) pair is seen.
+        bool accept(unsigned int session, unsigned int serial) {
+            Sender& sender = find(session, serial);
+            sender.last_used = ++clock;
+            int ahead = (int)(serial - sender.highest);
+            if(ahead > 0) {
+                shift(sender, ahead);
+                sender.highest = serial;
+                sender.bitmap[0] |= 1;
+                return true;
+            }
+            unsigned int behind = (unsigned int)(-ahead);
+            if(behind >= (unsigned int)Window) return false;
+            boost::uint64_t bit = ONE << (behind & 63);
+            boost::uint64_t& word = sender.bitmap[behind >> 6];
+            if(word & bit) return false;
+            word |= bit;
+            return true;
+        }
+
+    private:
+
+        static const int WORDS = (Window + 63) / 64;
+        static const boost::uint64_t ONE = 1;
+
+        // Bit i of the bitmap is serial highest - i.
+        struct Sender {
+            bool used;
+            unsigned int session;
+            unsigned int highest;
+            unsigned int last_used;
+            boost::uint64_t bitmap[WORDS];
+        };
+
+        Sender& find(unsigned int session, unsigned int serial) {
+            int oldest = 0;
+            for(int i = 0; i < Senders; i++) {
+                if(senders[i].used && senders[i].session == session) return senders[i];
+                if(!senders[i].used) {
+                    oldest = i;
+                    break;
+                }
+                if((int)(senders[i].last_used - senders[oldest].last_used) < 0) oldest = i;
+            }
+            // Start just below the first serial, so it is accepted.
+            Sender& sender = senders[oldest];
+            sender.used = true;
+            sender.session = session;
+            sender.highest = serial - 1;
+            for(int i = 0; i < WORDS; i++) sender.bitmap[i] = 0;
+            return sender;
+        }
+
+        // Move the window up by n serials.
+        static void shift(Sender& sender, int n) {
+            if(n >= Window) {
+                for(int i = 0; i < WORDS; i++) sender.bitmap[i] = 0;
+                return;
+            }
+            int words = n >> 6, bits = n & 63;
+            for(int i = WORDS - 1; i >= 0; i--) {
+                boost::uint64_t value = 0;
+                if(i - words >= 0) {
+                    value = sender.bitmap[i - words] << bits;
+                    if(bits > 0 && i - words - 1 >= 0) value |= sender.bitmap[i - words - 1] >> (64 - bits);
+                }
+                sender.bitmap[i] = value;
+            }
+        }
+
+        Sender senders[Senders];
+        unsigned int clock;
+    };
+
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef PianoConnect_statistics_h
+#define PianoConnect_statistics_h
+
+#include <algorithm>
+#include <cmath>
+
+// Windowed statistics over the most recent samples.
+
+namespace PianoConnect {
+
+    // Keeps the last Capacity samples in a ring, feed() never allocates.
+    //
+    // Mean and variance are updated Welford style as samples enter and
+    // leave the window, and recomputed from the ring once per Capacity
+    // samples so rounding errors can't build up. A sorted copy of the window
+    // gives minimum, maximum and percentiles in O(1); keeping it sorted costs
+    // a binary search and a move of at most Capacity doubles per sample.
+    // That is O(Capacity), not O(log n), but for the windows used here (40
+    // and 256) a sample and a percentile take 80-140 ns, see statistics_test.
+    // Much larger windows would want an order-statistic tree or a streaming
+    // sketch.
+    template < int Capacity >
+    class RunningStatistics {
+    public:
+
+        RunningStatistics() {
+            reset();
+        }
+
+        void reset() {
+            count = 0;
+            next = 0;
+            since_recompute = 0;
+            mean = 0;
+            m2 = 0;
+        }
+
+        void feed(double value) {
+            if(count == Capacity) {
+                double old = ring[next];
+                removeSorted(old);
+                // Welford, run backwards.
+                if(count > 1) {
+                    double d = old - mean;
+                    mean -= d / (count - 1);
+                    m2 -= d * (old - mean);
+                } else {
+                    mean = 0;
+                    m2 = 0;
+                }
+                count -= 1;
+            }
+            ring[next] = value;
+            next = (next + 1) % Capacity;
+            insertSorted(value);
+            count += 1;
+            double d = value - mean;
+            mean += d / count;
+            m2 += d * (value - mean);
+
+            since_recompute += 1;
+            if(since_recompute >= Capacity) recompute();
+        }
+
+        int size() const {
+            return count;
+        }
+
+        bool empty() const {
+            return count == 0;
+        }
+
+        double average() const {
+            return count > 0 ? mean : 0;
+        }
+
+        double variance() const {
+            return count > 1 ? std::max(0.0, m2 / (count - 1)) : 0;
+        }
+
+        double deviation() const {
+            return std::sqrt(variance());
+        }
+
+        double minimum() const {
+            return count > 0 ? sorted[0] : 0;
+        }
+
+        double maximum() const {
+            return count > 0 ? sorted[count - 1] : 0;
+        }
+
+        // p in [0, 1], interpolated between neighbouring samples.
+        double percentile(double p) const {
+            if(count == 0) return 0;
+            double position = std::min(std::max(p, 0.0), 1.0) * (count - 1);
+            int index = (int)position;
+            if(index >= count - 1) return sorted[count - 1];
+            double fraction = position - index;
+            return sorted[index] + (sorted[index + 1] - sorted[index]) * fraction;
+        }
+
+    private:
+
+        void insertSorted(double value) {
+            double* at = std::upper_bound(sorted, sorted + count, value);
+            std::copy_backward(at, sorted + count, sorted + count + 1);
+            *at = value;
+        }
+
+        void removeSorted(double value) {
+            double* at = std::lower_bound(sorted, sorted + count, value);
+            std::copy(at + 1, sorted + count, at);
+        }
+
+        // Exact two-pass mean and variance of the window.
+        void recompute() {
+            since_recompute = 0;
+            double sum = 0;
+            for(int i = 0; i < count; i++) sum += sorted[i];
+            mean = sum / count;
+            m2 = 0;
+            for(int i = 0; i < count; i++) {
+                double d = sorted[i] - mean;
+                m2 += d * d;
+            }
+        }
+
+        double ring[Capacity];
+        double sorted[Capacity];
+        int count, next, since_recompute;
+        double mean, m2;
+    };
+
+}
+
+#endif
@@ -1,29 +1,63 @@
 #ifndef PianoConnect_timer_h
 #define PianoConnect_timer_h
 
+#include <string>
+
+#include <boost/cstdint.hpp>
+
 // Abstract classes for networking.
 
 namespace PianoConnect {
 
+    // Clock sources for precise_time(), all monotonic: wall clock changes
+    // and NTP steps never move them.
+    enum ClockSource {
+        // CLOCK_MONOTONIC, rate disciplined by NTP (default).
+        CLOCK_SOURCE_MONOTONIC,
+        // CLOCK_MONOTONIC_RAW, the bare oscillator, never slewed.
+        CLOCK_SOURCE_MONOTONIC_RAW,
+        // Invariant TSC calibrated against CLOCK_MONOTONIC_RAW, x86 only.
+        CLOCK_SOURCE_TSC
+    };
+
+    // Select the source before any timestamps are taken.
+    // Returns false and keeps the current source if it is not available.
+    bool setClockSource(ClockSource source);
+    ClockSource getClockSource();
+    const char* clockSourceName(ClockSource source);
+    bool parseClockSource(const std::string& name, ClockSource& source);
+
+    // Time in nanoseconds, machine specific offset.
+    boost::int64_t precise_time_ns();
     // Get precise time in seconds, machine specific offset.
     double precise_time();
     // Sleep in seconds, (caution: will not sleep if <= 1ms in windows).
     void sleep(double seconds);
 
-    class HighResolutionTimer {
+    // Deadline value meaning "nothing scheduled".
+    const double DEADLINE_NONE = 1e300;
+
+    // Timer that sleeps until an absolute deadline (in precise_time() seconds)
+    // instead of waking periodically.
+    class DeadlineTimer {
     public:
 
         class Delegate {
         public:
-            virtual void onTimer() = 0;
+            // Called from the timer thread once the deadline has passed.
+            // Returns the next deadline, or DEADLINE_NONE to sleep until woken.
+            virtual double onDeadline(double now) = 0;
             virtual ~Delegate() { }
         };
 
         virtual void setDelegate(Delegate* delegate) = 0;
 
-        virtual ~HighResolutionTimer() { }
+        // Make sure the delegate runs no later than deadline, thread-safe.
+        virtual void wakeAt(double deadline) = 0;
+
+        virtual ~DeadlineTimer() { }
 
-        static HighResolutionTimer* Create(double interval);
+        static DeadlineTimer* Create();
     };
 
 }
@@ -0,0 +1,265 @@
+#ifndef PianoConnect_timingwheel_h
+#define PianoConnect_timingwheel_h
+
+#include <vector>
+#include <cmath>
+
+#include <boost/cstdint.hpp>
+
+// Hierarchical timing wheel (calendar queue) for timestamped events.
+
+namespace PianoConnect {
+
+    // T must have a double 'timestamp' member, in seconds.
+    //
+    // Level 0 has 256 slots of 'resolution' seconds each, level 1 has 64 slots
+    // of 256 level-0 slots each; anything further out waits in a sorted
+    // overflow list. Each slot is a list ordered by (timestamp, arrival), so
+    // events sharing a timestamp come out in the order they were pushed.
+    // Slots rarely hold more than a few events, which keeps push O(1) in
+    // practice; expiry and top() are O(1) using per-level occupancy bitmaps.
+    template < typename T >
+    class TimingWheel {
+    public:
+
+        TimingWheel(double resolution_ = 1e-3, size_t capacity = 1024) {
+            resolution = resolution_;
+            current = 0;
+            count = 0;
+            sequence = 0;
+            free_list = -1;
+            nodes.reserve(capacity);
+            for(int i = 0; i < L0_SIZE; i++) level0[i] = List();
+            for(int i = 0; i < L1_SIZE; i++) level1[i] = List();
+            for(int i = 0; i < L0_SIZE / 64; i++) level0_bitmap[i] = 0;
+            level1_bitmap = 0;
+        }
+
+        bool empty() const {
+            return count == 0;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        void push(const T& value) {
+            int n = allocate();
+            nodes[n].value = value;
+            nodes[n].tick = tickOf(value.timestamp);
+            nodes[n].sequence = sequence++;
+            // An empty wheel can start anywhere; start a little before the new
+            // event so slightly earlier arrivals still land in their own slot.
+            if(count == 0) current = nodes[n].tick - L0_SIZE / 4;
+            place(n);
+            count += 1;
+        }
+
+        // Earliest event, wheel must not be empty.
+        const T& top() const {
+            int best = -1;
+            int slot = (int)(current & L0_MASK);
+            int index = findLevel0(slot);
+            if(index < 0) index = findLevel0(0);
+            if(index >= 0) best = level0[index].head;
+            boost::int64_t block = current >> L0_BITS;
+            index = findLevel1((int)((block + 1) & L1_MASK));
+            if(index < 0) index = findLevel1(0);
+            if(index >= 0 && (best < 0 || before(level1[index].head, best))) best = level1[index].head;
+            if(overflow.head >= 0 && (best < 0 || before(overflow.head, best))) best = overflow.head;
+            return nodes[best].value;
+        }
+
+        // Pop the earliest event if it is due at 'now'.
+        bool popDue(double now, T& value) {
+            if(count == 0) return false;
+            advanceTo(tickOf(now));
+            int slot = (int)(current & L0_MASK);
+            List& list = level0[slot];
+            if(list.head < 0 || nodes[list.head].value.timestamp > now) return false;
+            int n = unlinkHead(list);
+            if(list.head < 0) level0_bitmap[slot >> 6] &= ~(ONE << (slot & 63));
+            value = nodes[n].value;
+            release(n);
+            count -= 1;
+            return true;
+        }
+
+    private:
+
+        static const int L0_BITS = 8;
+        static const int L0_SIZE = 1 << L0_BITS;
+        static const boost::int64_t L0_MASK = L0_SIZE - 1;
+        static const int L1_BITS = 6;
+        static const int L1_SIZE = 1 << L1_BITS;
+        static const boost::int64_t L1_MASK = L1_SIZE - 1;
+        static const boost::uint64_t ONE = 1;
+
+        struct Node {
+            T value;
+            boost::int64_t tick;
+            unsigned int sequence;
+            int next;
+        };
+
+        struct List {
+            int head, tail;
+            List() : head(-1), tail(-1) { }
+        };
+
+        boost::int64_t tickOf(double timestamp) const {
+            return (boost::int64_t)std::floor(timestamp / resolution);
+        }
+
+        // Order by timestamp, then by arrival.
+        bool before(int a, int b) const {
+            if(nodes[a].value.timestamp != nodes[b].value.timestamp)
+                return nodes[a].value.timestamp < nodes[b].value.timestamp;
+            return (int)(nodes[a].sequence - nodes[b].sequence) < 0;
+        }
+
+        int allocate() {
+            if(free_list >= 0) {
+                int n = free_list;
+                free_list = nodes[n].next;
+                return n;
+            }
+            nodes.push_back(Node());
+            return (int)nodes.size() - 1;
+        }
+
+        void release(int n) {
+            nodes[n].next = free_list;
+            free_list = n;
+        }
+
+        void insert(List& list, int n) {
+            nodes[n].next = -1;
+            if(list.head < 0) {
+                list.head = list.tail = n;
+            } else if(!before(n, list.tail)) {
+                nodes[list.tail].next = n;
+                list.tail = n;
+            } else {
+                int prev = -1, cur = list.head;
+                while(!before(n, cur)) {
+                    prev = cur;
+                    cur = nodes[cur].next;
+                }
+                nodes[n].next = cur;
+                if(prev < 0) list.head = n;
+                else nodes[prev].next = n;
+            }
+        }
+
+        int unlinkHead(List& list) {
+            int n = list.head;
+            list.head = nodes[n].next;
+            if(list.head < 0) list.tail = -1;
+            return n;
+        }
+
+        // Put a node on the level matching its distance from the cursor.
+        // Late events are clamped into the current slot.
+        void place(int n) {
+            boost::int64_t tick = nodes[n].tick;
+            if(tick < current) tick = current;
+            if(tick - current < L0_SIZE) {
+                int slot = (int)(tick & L0_MASK);
+                insert(level0[slot], n);
+                level0_bitmap[slot >> 6] |= ONE << (slot & 63);
+            } else if((tick >> L0_BITS) - (current >> L0_BITS) < L1_SIZE) {
+                int slot = (int)((tick >> L0_BITS) & L1_MASK);
+                insert(level1[slot], n);
+                level1_bitmap |= ONE << slot;
+            } else {
+                insert(overflow, n);
+            }
+        }
+
+        // Entering a new level-0 block: pull its events down from level 1,
+        // refilling level 1 from the overflow list when it wraps around.
+        void cascade() {
+            boost::int64_t block = current >> L0_BITS;
+            if((block & L1_MASK) == 0) {
+                while(overflow.head >= 0 && (nodes[overflow.head].tick >> L0_BITS) - block < L1_SIZE) {
+                    place(unlinkHead(overflow));
+                }
+            }
+            int slot = (int)(block & L1_MASK);
+            List& list = level1[slot];
+            while(list.head >= 0) {
+                place(unlinkHead(list));
+            }
+            level1_bitmap &= ~(ONE << slot);
+        }
+
+        // Move the cursor towards 'target', stopping at the first occupied slot.
+        void advanceTo(boost::int64_t target) {
+            while(current < target) {
+                if(count == 0) {
+                    current = target;
+                    return;
+                }
+                int slot = (int)(current & L0_MASK);
+                if(level0[slot].head >= 0) return;
+                int next = slot + 1 < L0_SIZE ? findLevel0(slot + 1) : -1;
+                if(next >= 0) {
+                    boost::int64_t tick = (current & ~L0_MASK) + next;
+                    current = tick < target ? tick : target;
+                    continue;
+                }
+                boost::int64_t boundary = (current | L0_MASK) + 1;
+                if(boundary > target) {
+                    current = target;
+                    return;
+                }
+                current = boundary;
+                cascade();
+            }
+        }
+
+        static int lowestBit(boost::uint64_t x) {
+        #if defined(__GNUC__)
+            return __builtin_ctzll(x);
+        #else
+            int n = 0;
+            while(!(x & 1)) { x >>= 1; n++; }
+            return n;
+        #endif
+        }
+
+        // First occupied level-0 slot at index >= from, or -1.
+        int findLevel0(int from) const {
+            for(int word = from >> 6; word < L0_SIZE / 64; word++) {
+                boost::uint64_t bits = level0_bitmap[word];
+                if(word == (from >> 6)) bits &= ~((ONE << (from & 63)) - 1);
+                if(bits) return (word << 6) + lowestBit(bits);
+            }
+            return -1;
+        }
+
+        // First occupied level-1 slot at index >= from, or -1.
+        int findLevel1(int from) const {
+            boost::uint64_t bits = level1_bitmap & ~((ONE << from) - 1);
+            return bits ? lowestBit(bits) : -1;
+        }
+
+        double resolution;
+        boost::int64_t current;
+        size_t count;
+        unsigned int sequence;
+
+        std::vector<Node> nodes;
+        int free_list;
+
+        List level0[L0_SIZE];
+        List level1[L1_SIZE];
+        List overflow;
+        boost::uint64_t level0_bitmap[L0_SIZE / 64];
+        boost::uint64_t level1_bitmap;
+    };
+
+}
+
+#endif
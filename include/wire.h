@@ -0,0 +1,145 @@
+#ifndef PianoConnect_wire_h
+#define PianoConnect_wire_h
+
+#include "protocol.h"
+#include "timer.h"
+
+#include <boost/cstdint.hpp>
+#include <boost/thread.hpp>
+
+// Compact, explicitly encoded wire format for MIDI and parity packets.
+//
+// Version 1, all integers little endian, varints 7 bits per byte, low first:
+//
+//   MIDI:    0xE0 | flags, session (16 bits), serial (16 bits), timestamp (24 bits),
+//            [length], message bytes,
+//            [echo timestamp (32 bits), echo hold (varint)],
+//            [count, count x (serial delta (varint), age (varint), message bytes)]
+//   Parity:  0xE8, count, session (16 bits), first serial (16 bits), record
+//   Bundle:  0xE9, count, MIDI packet,
+//            count x (varint: zigzag timestamp delta << 1 | has length,
+//                     [length], message bytes)
+//
+// Timestamps are microseconds of the sender's clock modulo 2^24, about
+// 16.8 s. The receiver unwraps them against its estimate of that clock,
+// which has to be within 8 s; MIDI waits for the first sync round. Echo
+// timestamps are our own clock and go modulo 2^32. Serials are sent as
+// their low 16 bits, in effect a delta against the last one the receiver
+// saw, not against the previous packet, so no packet depends on an
+// earlier one. The length byte is only sent when the status byte doesn't
+// imply it. A 3-byte note takes 11 bytes, 4 more in a bundle; bundled
+// messages have the serials following the first one's.
+//
+// Held messages always go in a bundle, even alone, and without echo
+// fields: their timestamps aren't when they were sent, so they aren't
+// clock samples. The session is 16 bits so a restarted sender rarely
+// reuses its last run's, whose serials would look like replays: about
+// one restart in 65536.
+
+namespace PianoConnect {
+
+    const unsigned char WIRE_V1_MIDI = 0xE0;
+    const unsigned char WIRE_V1_PARITY = 0xE8;
+    const unsigned char WIRE_V1_BUNDLE = 0xE9;
+
+    const unsigned char WIRE_FLAG_ECHO = 0x01;
+    const unsigned char WIRE_FLAG_JOURNAL = 0x02;
+    const unsigned char WIRE_FLAG_LENGTH = 0x04;
+
+    const int WIRE_MAX_SIZE = 256;
+    // Datagram size and message count limits of a bundle.
+    const int WIRE_BUNDLE_MAX_SIZE = 1200;
+    const int WIRE_MAX_BUNDLE = 64;
+
+    inline bool isWireMIDI(unsigned char type) {
+        return (type & 0xF8) == WIRE_V1_MIDI;
+    }
+
+    // Bytes in a message starting with 'status', 0 if it can't be told.
+    int impliedLength(unsigned char status);
+
+    // Encode a PACKET_MIDIMessage, PACKET_MIDIMessageEcho or
+    // PACKET_MIDIMessageJournal, returns the number of bytes written.
+    int encodeMIDIPacket(const Packet_MIDIMessageJournal& packet, unsigned char* buffer);
+    int encodeParity(const Packet_Parity& parity, unsigned char* buffer);
+
+    // Parity record of a message, MIDI_RECORD_SIZE bytes.
+    void encodeRecord(const MIDIMessage& message, unsigned char* record);
+    void decodeRecord(const unsigned char* record, MIDIMessage& message);
+
+    // Receiver side, owned by the network thread.
+    class WireDecoder {
+    public:
+
+        WireDecoder();
+
+        // 'local_now' is our clock, 'remote_now' our estimate of the
+        // sender's. Returns the size of the struct the packet decodes to,
+        // 0 if it is malformed.
+        int decodeMIDIPacket(const unsigned char* buffer, int size, double local_now, double remote_now, Packet_MIDIMessageJournal& packet);
+        bool decodeParity(const unsigned char* buffer, int size, Packet_Parity& parity);
+        // The first message goes to 'first', the others to 'rest'. Returns
+        // the number of others, -1 if the bundle is malformed.
+        int decodeBundle(const unsigned char* buffer, int size, double local_now, double remote_now,
+                         Packet_MIDIMessageJournal& first, int& first_size, Packet_MIDIMessage* rest, int max_rest);
+
+    private:
+
+        // As above, also returning the number of bytes used.
+        int decodeMIDIPacket(const unsigned char* buffer, int size, double local_now, double remote_now, Packet_MIDIMessageJournal& packet, int& used);
+
+        // Full serial closest to the last one seen in the session.
+        unsigned int extendSerial(unsigned int session, unsigned int low);
+
+        bool has_serial;
+        unsigned int last_session, last_serial;
+    };
+
+    // Packs messages sent close together into one datagram. A message goes
+    // out at once unless another did less than 'window' seconds ago; then
+    // it is held, with any that follow, until the window closes or the
+    // bundle is full. A lone note is never delayed, a chord or a pedal
+    // sweep takes a datagram per window.
+    class MessageBundler {
+    public:
+
+        MessageBundler(double window = 0.001);
+
+        void setWindow(double window);
+
+        // A message sent at 'now'. True when a datagram is ready in
+        // 'datagram' (WIRE_BUNDLE_MAX_SIZE bytes), which may hold only
+        // messages from before this one.
+        bool add(double now, const Packet_MIDIMessageJournal& packet, unsigned char* datagram, int& size);
+
+        // Take the held bundle if its window has closed.
+        bool flush(double now, unsigned char* datagram, int& size);
+        // Take the held bundle now, window or not.
+        bool drain(double now, unsigned char* datagram, int& size);
+
+        // When the held bundle is due, DEADLINE_NONE if nothing is held.
+        double deadline();
+
+        void statistics(int& messages, int& datagrams);
+
+    private:
+
+        void take(double now, unsigned char* datagram, int& size);
+
+        double window;
+
+        // Bytes 0 and 1 are the bundle header, the first message follows.
+        unsigned char bundle[WIRE_BUNDLE_MAX_SIZE];
+        int bundle_size, count;
+        boost::int64_t last_timestamp;
+        unsigned int last_serial;
+        double last_sent, held_until;
+
+        int num_messages, num_datagrams;
+
+        boost::mutex mutex;
+    };
+
+}
+
+#endif
@@ -989,11 +989,11 @@ void MidiOutCore :: openVirtualPort( std::string portName )
 //  free( sreq );
 //}
 
-void MidiOutCore :: sendMessage( std::vector<unsigned char> *message )
+void MidiOutCore :: sendMessage( const unsigned char *message, size_t size )
 {
   // We use the MIDISendSysex() function to asynchronously send sysex
   // messages.  Otherwise, we use a single CoreMidi MIDIPacket.
-  unsigned int nBytes = message->size();
+  unsigned int nBytes = (unsigned int) size;
   if ( nBytes == 0 ) {
     errorString_ = "MidiOutCore::sendMessage: no data in message argument!";
     error( RtMidiError::WARNING, errorString_ );
@@ -1011,7 +1011,7 @@ void MidiOutCore :: sendMessage( std::vector<unsigned char> *message )
     // messages through the normal mechanism.  In addition, this avoids
     // the problem of virtual ports not receiving sysex messages.
 
-  if ( message->at(0) == 0xF0 ) {
+  if ( message[0] == 0xF0 ) {
 
     // Apple's fantastic API requires us to free the allocated data in
     // the completion callback but trashes the pointer and size before
@@ -1024,7 +1024,7 @@ void MidiOutCore :: sendMessage( std::vector<unsigned char> *message )
     char * sysexBuffer = ((char *) newRequest) + sizeof(struct MIDISysexSendRequest);
 
     // Copy data to buffer.
-    for ( unsigned int i=0; i<nBytes; ++i ) sysexBuffer[i] = message->at(i);
+    for ( unsigned int i=0; i<nBytes; ++i ) sysexBuffer[i] = message[i];
 
     newRequest->destination = data->destinationId;
     newRequest->data = (Byte *)sysexBuffer;
@@ -1051,7 +1051,7 @@ void MidiOutCore :: sendMessage( std::vector<unsigned char> *message )
 
   MIDIPacketList packetList;
   MIDIPacket *packet = MIDIPacketListInit( &packetList );
-  packet = MIDIPacketListAdd( &packetList, sizeof(packetList), packet, timeStamp, nBytes, (const Byte *) &message->at( 0 ) );
+  packet = MIDIPacketListAdd( &packetList, sizeof(packetList), packet, timeStamp, nBytes, (const Byte *) message );
   if ( !packet ) {
     errorString_ = "MidiOutCore::sendMessage: could not allocate packet list";
     error( RtMidiError::DRIVER_ERROR, errorString_ );
@@ -1278,6 +1278,9 @@ static void *alsaMidiHandler( void *ptr )
           // Method 2: Use the ALSA sequencer event time data.
           // (thanks to Pedro Lopez-Cabanillas!).
           time = ( ev->time.time.tv_sec * 1000000 ) + ( ev->time.time.tv_nsec/1000 );
+#ifndef AVOID_TIMESTAMPING
+          data->eventTime = ev->time.time.tv_sec + ev->time.time.tv_nsec * 1e-9;
+#endif
           lastTime = time;
           time -= apiData->lastTime;
           apiData->lastTime = lastTime;
@@ -1428,6 +1431,20 @@ unsigned int portInfo( snd_seq_t *seq, snd_seq_port_info_t *pinfo, unsigned int
   return 0;
 }
 
+double MidiInAlsa :: getQueueTime( void )
+{
+#ifndef AVOID_TIMESTAMPING
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  snd_seq_queue_status_t *status;
+  snd_seq_queue_status_alloca( &status );
+  if ( snd_seq_get_queue_status( data->seq, data->queue_id, status ) < 0 ) return 0.0;
+  const snd_seq_real_time_t *time = snd_seq_queue_status_get_real_time( status );
+  return time->tv_sec + time->tv_nsec * 1e-9;
+#else
+  return 0.0;
+#endif
+}
+
 unsigned int MidiInAlsa :: getPortCount()
 {
   snd_seq_port_info_t *pinfo;
@@ -1681,6 +1698,7 @@ MidiOutAlsa :: ~MidiOutAlsa()
   // Cleanup.
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
   if ( data->vport >= 0 ) snd_seq_delete_port( data->seq, data->vport );
+  if ( data->queue_id >= 0 ) snd_seq_free_queue( data->seq, data->queue_id );
   if ( data->coder ) snd_midi_event_free( data->coder );
   if ( data->buffer ) free( data->buffer );
   snd_seq_close( data->seq );
@@ -1706,6 +1724,7 @@ void MidiOutAlsa :: initialize( const std::string& clientName )
   data->seq = seq;
   data->portNum = -1;
   data->vport = -1;
+  data->queue_id = -1;
   data->bufferSize = 32;
   data->coder = 0;
   data->buffer = 0;
@@ -1854,11 +1873,71 @@ void MidiOutAlsa :: openVirtualPort( std::string portName )
   }
 }
 
-void MidiOutAlsa :: sendMessage( std::vector<unsigned char> *message )
+void MidiOutAlsa :: sendMessage( const unsigned char *message, size_t size )
+{
+  outputMessage( message, size, -1.0, true );
+}
+
+void MidiOutAlsa :: bufferMessage( const unsigned char *message, size_t size )
+{
+  outputMessage( message, size, -1.0, false );
+}
+
+void MidiOutAlsa :: flushMessages( void )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  snd_seq_drain_output( data->seq );
+}
+
+bool MidiOutAlsa :: startQueue( void )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( data->queue_id >= 0 ) return true;
+
+  data->queue_id = snd_seq_alloc_named_queue( data->seq, "RtMidi Output Queue" );
+  if ( data->queue_id < 0 ) {
+    errorString_ = "MidiOutAlsa::startQueue: ALSA error allocating output queue.";
+    error( RtMidiError::WARNING, errorString_ );
+    return false;
+  }
+  snd_seq_start_queue( data->seq, data->queue_id, NULL );
+  snd_seq_drain_output( data->seq );
+  return true;
+}
+
+double MidiOutAlsa :: getQueueTime( void )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( data->queue_id < 0 ) return 0.0;
+
+  snd_seq_queue_status_t *status;
+  snd_seq_queue_status_alloca( &status );
+  if ( snd_seq_get_queue_status( data->seq, data->queue_id, status ) < 0 ) return 0.0;
+  const snd_seq_real_time_t *time = snd_seq_queue_status_get_real_time( status );
+  return time->tv_sec + time->tv_nsec * 1e-9;
+}
+
+void MidiOutAlsa :: sendMessageAt( double queueTime, const unsigned char *message, size_t size )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( data->queue_id < 0 ) queueTime = -1.0;
+  else if ( queueTime < 0.0 ) queueTime = 0.0;
+  outputMessage( message, size, queueTime, true );
+}
+
+void MidiOutAlsa :: bufferMessageAt( double queueTime, const unsigned char *message, size_t size )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( data->queue_id < 0 ) queueTime = -1.0;
+  else if ( queueTime < 0.0 ) queueTime = 0.0;
+  outputMessage( message, size, queueTime, false );
+}
+
+void MidiOutAlsa :: outputMessage( const unsigned char *message, size_t size, double queueTime, bool drain )
 {
   int result;
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
-  unsigned int nBytes = message->size();
+  unsigned int nBytes = (unsigned int) size;
   if ( nBytes > data->bufferSize ) {
     data->bufferSize = nBytes;
     result = snd_midi_event_resize_buffer ( data->coder, nBytes);
@@ -1867,22 +1946,24 @@ void MidiOutAlsa :: sendMessage( std::vector<unsigned char> *message )
       error( RtMidiError::DRIVER_ERROR, errorString_ );
       return;
     }
-    free (data->buffer);
-    data->buffer = (unsigned char *) malloc( data->bufferSize );
-    if ( data->buffer == NULL ) {
-    errorString_ = "MidiOutAlsa::initialize: error allocating buffer memory!\n\n";
-    error( RtMidiError::MEMORY_ERROR, errorString_ );
-    return;
-    }
   }
 
   snd_seq_event_t ev;
   snd_seq_ev_clear(&ev);
   snd_seq_ev_set_source(&ev, data->vport);
   snd_seq_ev_set_subs(&ev);
-  snd_seq_ev_set_direct(&ev);
-  for ( unsigned int i=0; i<nBytes; ++i ) data->buffer[i] = message->at(i);
-  result = snd_midi_event_encode( data->coder, data->buffer, (long)nBytes, &ev );
+  if ( queueTime < 0.0 ) {
+    snd_seq_ev_set_direct(&ev);
+  }
+  else {
+    // Let the kernel sequencer deliver the event at an absolute queue time.
+    snd_seq_real_time_t time;
+    time.tv_sec = (unsigned int) queueTime;
+    time.tv_nsec = (unsigned int) ( ( queueTime - time.tv_sec ) * 1e9 );
+    snd_seq_ev_schedule_real(&ev, data->queue_id, 0, &time);
+  }
+  // The encoder reads the caller's bytes directly, no copy.
+  result = snd_midi_event_encode( data->coder, message, (long)nBytes, &ev );
   if ( result < (int)nBytes ) {
     errorString_ = "MidiOutAlsa::sendMessage: event parsing error!";
     error( RtMidiError::WARNING, errorString_ );
@@ -1890,13 +1971,23 @@ void MidiOutAlsa :: sendMessage( std::vector<unsigned char> *message )
   }
 
   // Send the event.
-  result = snd_seq_event_output(data->seq, &ev);
+  if ( drain ) {
+    result = snd_seq_event_output(data->seq, &ev);
+  }
+  else {
+    // Only drain early if the client buffer is full.
+    result = snd_seq_event_output_buffer(data->seq, &ev);
+    if ( result == -EAGAIN ) {
+      snd_seq_drain_output(data->seq);
+      result = snd_seq_event_output_buffer(data->seq, &ev);
+    }
+  }
   if ( result < 0 ) {
     errorString_ = "MidiOutAlsa::sendMessage: error sending MIDI message to port.";
     error( RtMidiError::WARNING, errorString_ );
     return;
   }
-  snd_seq_drain_output(data->seq);
+  if ( drain ) snd_seq_drain_output(data->seq);
 }
 
 #endif // __LINUX_ALSA__
@@ -2343,11 +2434,11 @@ void MidiOutWinMM :: openVirtualPort( std::string /*portName*/ )
   error( RtMidiError::WARNING, errorString_ );
 }
 
-void MidiOutWinMM :: sendMessage( std::vector<unsigned char> *message )
+void MidiOutWinMM :: sendMessage( const unsigned char *message, size_t size )
 {
   if ( !connected_ ) return;
 
-  unsigned int nBytes = static_cast<unsigned int>(message->size());
+  unsigned int nBytes = static_cast<unsigned int>(size);
   if ( nBytes == 0 ) {
     errorString_ = "MidiOutWinMM::sendMessage: message argument is empty!";
     error( RtMidiError::WARNING, errorString_ );
@@ -2356,7 +2447,7 @@ void MidiOutWinMM :: sendMessage( std::vector<unsigned char> *message )
 
   MMRESULT result;
   WinMidiData *data = static_cast<WinMidiData *> (apiData_);
-  if ( message->at(0) == 0xF0 ) { // Sysex message
+  if ( message[0] == 0xF0 ) { // Sysex message
 
     // Allocate buffer for sysex data.
     char *buffer = (char *) malloc( nBytes );
@@ -2367,7 +2458,7 @@ void MidiOutWinMM :: sendMessage( std::vector<unsigned char> *message )
     }
 
     // Copy data to buffer.
-    for ( unsigned int i=0; i<nBytes; ++i ) buffer[i] = message->at(i);
+    for ( unsigned int i=0; i<nBytes; ++i ) buffer[i] = message[i];
 
     // Create and prepare MIDIHDR structure.
     MIDIHDR sysex;
@@ -2408,7 +2499,7 @@ void MidiOutWinMM :: sendMessage( std::vector<unsigned char> *message )
     DWORD packet;
     unsigned char *ptr = (unsigned char *) &packet;
     for ( unsigned int i=0; i<nBytes; ++i ) {
-      *ptr = message->at(i);
+      *ptr = message[i];
       ++ptr;
     }
 
@@ -2825,14 +2916,13 @@ void MidiOutJack :: closePort()
   data->port = NULL;
 }
 
-void MidiOutJack :: sendMessage( std::vector<unsigned char> *message )
+void MidiOutJack :: sendMessage( const unsigned char *message, size_t size )
 {
-  int nBytes = message->size();
+  int nBytes = (int) size;
   JackMidiData *data = static_cast<JackMidiData *> (apiData_);
 
   // Write full message to buffer
-  jack_ringbuffer_write( data->buffMessage, ( const char * ) &( *message )[0],
-                         message->size() );
+  jack_ringbuffer_write( data->buffMessage, ( const char * ) message, size );
   jack_ringbuffer_write( data->buffSize, ( char * ) &nBytes, sizeof( nBytes ) );
 }
 
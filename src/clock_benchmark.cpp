@@ -0,0 +1,49 @@
+// Clock source benchmark: cost per reading and resolution of each source.
+
+#include "timer.h"
+
+#include <iostream>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace PianoConnect;
+using namespace std;
+
+const int NUM_READINGS = 5000000;
+
+// The old precise_time(): wall clock local time through boost.
+double wall_clock_time() {
+    static boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+    return (boost::posix_time::microsec_clock::local_time() - epoch).total_microseconds() / 1000000.0;
+}
+
+int main() {
+    // Baseline, timed with the default source.
+    {
+        volatile double sink;
+        boost::int64_t t0 = precise_time_ns();
+        for(int i = 0; i < NUM_READINGS; i++) sink = wall_clock_time();
+        (void)sink;
+        boost::int64_t t1 = precise_time_ns();
+        cout << "wall clock (boost): " << (double)(t1 - t0) / NUM_READINGS << " ns/reading" << endl;
+    }
+
+    ClockSource sources[] = { CLOCK_SOURCE_MONOTONIC, CLOCK_SOURCE_MONOTONIC_RAW, CLOCK_SOURCE_TSC };
+    for(int s = 0; s < 3; s++) {
+        if(!setClockSource(sources[s])) {
+            cout << clockSourceName(sources[s]) << ": not available" << endl;
+            continue;
+        }
+        // Smallest non-zero step between consecutive readings.
+        boost::int64_t resolution = 0;
+        boost::int64_t previous = precise_time_ns();
+        boost::int64_t t0 = previous;
+        for(int i = 0; i < NUM_READINGS; i++) {
+            boost::int64_t t = precise_time_ns();
+            if(t != previous && (resolution == 0 || t - previous < resolution)) resolution = t - previous;
+            previous = t;
+        }
+        cout << clockSourceName(sources[s]) << ": " << (double)(previous - t0) / NUM_READINGS << " ns/reading, "
+             << "step " << resolution << " ns" << endl;
+    }
+}
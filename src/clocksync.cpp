@@ -0,0 +1,220 @@
+#include "clocksync.h"
+
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+
+namespace PianoConnect {
+
+    // Skew is only fitted once the samples span this many seconds.
+    const double MIN_SKEW_SPAN = 10.0;
+    // Crystals are good to a few tens of ppm, anything far beyond is noise.
+    const double MAX_SKEW = 500e-6;
+    // Floor for the round trip used in the weights.
+    const double MIN_RTT = 1e-4;
+    // Minimum spacing of fitted rounds.
+    const double MIN_SAMPLE_SPACING = 0.05;
+
+    ClockModel::ClockModel(double window_, size_t max_samples_) {
+        window = window_;
+        max_samples = max_samples_;
+        mean_local = 0;
+        mean_offset = 0;
+        slope = 0;
+        prior_skew = 0;
+        filter_count = 0;
+        filter_next = 0;
+        last_used = -1;
+        filter_dispersion = 0;
+    }
+
+    void ClockModel::feed(double local_sent, double remote_received, double remote_sent, double local_received) {
+        // Same offset and round trip as an instant reply in the middle of the hold.
+        double hold = remote_sent - remote_received;
+        feed(local_sent + hold / 2.0, (remote_received + remote_sent) / 2.0, local_received - hold / 2.0);
+    }
+
+    void ClockModel::feed(double local_sent, double remote, double local_received) {
+        double rtt = local_received - local_sent;
+        if(rtt < 0) return;
+        if(rtt < MIN_RTT) rtt = MIN_RTT;
+        FilterSample& slot = filter[filter_next];
+        slot.local = (local_sent + local_received) / 2.0;
+        slot.offset = remote - slot.local;
+        slot.rtt = rtt;
+        filter_next = (filter_next + 1) % FILTER_SIZE;
+        if(filter_count < FILTER_SIZE) filter_count += 1;
+
+        // Order the filter by round trip.
+        int order[FILTER_SIZE];
+        for(int i = 0; i < filter_count; i++) {
+            int j = i;
+            while(j > 0 && filter[order[j - 1]].rtt > filter[i].rtt) {
+                order[j] = order[j - 1];
+                j -= 1;
+            }
+            order[j] = i;
+        }
+        const FilterSample& best = filter[order[0]];
+        // Dispersion as in NTP: offset differences, halving the weight at each rank.
+        filter_dispersion = 0;
+        double factor = 0.5;
+        for(int i = 1; i < filter_count; i++) {
+            factor *= 0.5;
+            filter_dispersion += std::fabs(filter[order[i]].offset - best.offset) * factor;
+        }
+        filter_dispersion += best.rtt / 2.0;
+
+        // Each round is used at most once, and never out of order.
+        if(best.local <= last_used) return;
+        if(!samples.empty() && best.local - last_used < MIN_SAMPLE_SPACING) return;
+        last_used = best.local;
+
+        Sample sample;
+        sample.local = best.local;
+        sample.offset = best.offset;
+        sample.weight = 1.0 / (best.rtt * best.rtt);
+        samples.push_back(sample);
+        while(samples.size() > max_samples || samples.front().local < sample.local - window) {
+            samples.pop_front();
+        }
+        fit();
+    }
+
+    void ClockModel::seed(double skew) {
+        // Used from the first fit on; before it there is no offset to drift from.
+        prior_skew = skew;
+    }
+
+    void ClockModel::fit() {
+        // Weighted means first, then the slope about them; times are seconds
+        // since boot, up to months on a long-running host, so everything is
+        // centred on the first sample.
+        double t0 = samples.front().local;
+        double sw = 0, sx = 0, sy = 0;
+        for(size_t i = 0; i < samples.size(); i++) {
+            const Sample& s = samples[i];
+            sw += s.weight;
+            sx += s.weight * (s.local - t0);
+            sy += s.weight * s.offset;
+        }
+        double mx = sx / sw, my = sy / sw;
+        double sxx = 0, sxy = 0;
+        for(size_t i = 0; i < samples.size(); i++) {
+            const Sample& s = samples[i];
+            double dx = s.local - t0 - mx;
+            sxx += s.weight * dx * dx;
+            sxy += s.weight * dx * (s.offset - my);
+        }
+        mean_local = t0 + mx;
+        mean_offset = my;
+        slope = prior_skew;
+        if(samples.back().local - samples.front().local >= MIN_SKEW_SPAN && sxx > 0) {
+            slope = sxy / sxx;
+            if(slope > MAX_SKEW) slope = MAX_SKEW;
+            if(slope < -MAX_SKEW) slope = -MAX_SKEW;
+        }
+    }
+
+    bool ClockModel::valid() const {
+        return !samples.empty();
+    }
+
+    double ClockModel::offsetAt(double t) const {
+        return mean_offset + slope * (t - mean_local);
+    }
+
+    double ClockModel::skew() const {
+        return slope;
+    }
+
+    double ClockModel::dispersion() const {
+        return filter_dispersion;
+    }
+
+    double ClockModel::toLocal(double remote) const {
+        // Solve local = remote - offsetAt(local), relative to mean_local.
+        return mean_local + (remote - mean_offset - mean_local) / (1.0 + slope);
+    }
+
+    OffsetSlew::OffsetSlew(double window_, double max_slope_, double step_threshold_) {
+        window = window_;
+        max_slope = max_slope_;
+        step_threshold = step_threshold_;
+        error = 0;
+        last_time = 0;
+    }
+
+    void OffsetSlew::setWindow(double window_) {
+        window = window_;
+    }
+
+    void OffsetSlew::advance(double t) {
+        double dt = t - last_time;
+        if(last_time == 0 || dt < 0) dt = 0;
+        if(t > last_time) last_time = t;
+        if(error == 0 || dt == 0) return;
+        double step = window > 0 ? std::fabs(error) * std::min(1.0, dt / window) : std::fabs(error);
+        step = std::min(step, max_slope * dt);
+        if(step >= std::fabs(error)) error = 0;
+        else error -= error > 0 ? step : -step;
+    }
+
+    void OffsetSlew::correct(double t, double amount) {
+        advance(t);
+        // Keep applying the old offset, then work off the difference.
+        error -= amount;
+        if(std::fabs(error) > step_threshold) error = 0;
+    }
+
+    double OffsetSlew::residual(double t) {
+        advance(t);
+        return error;
+    }
+
+    double OffsetSlew::residual() const {
+        return error;
+    }
+
+    bool loadSyncCache(const std::string& file, const std::string& peer, SyncCalibration& calibration) {
+        std::ifstream stream(file.c_str());
+        std::string line;
+        while(std::getline(stream, line)) {
+            std::istringstream fields(line);
+            std::string name;
+            SyncCalibration entry;
+            std::string extra;
+            // Lines of older versions also carry the offset, skip them.
+            if(!(fields >> name >> entry.skew >> entry.latency) || fields >> extra) continue;
+            if(name == peer) {
+                calibration = entry;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void saveSyncCache(const std::string& file, const std::string& peer, const SyncCalibration& calibration) {
+        // Keep the other peers' lines.
+        std::vector<std::string> lines;
+        {
+            std::ifstream stream(file.c_str());
+            std::string line;
+            while(std::getline(stream, line)) {
+                std::istringstream fields(line);
+                std::string name;
+                if(fields >> name && name != peer) lines.push_back(line);
+            }
+        }
+        std::ofstream stream(file.c_str(), std::ios_base::trunc);
+        for(size_t i = 0; i < lines.size(); i++) {
+            stream << lines[i] << "\n";
+        }
+        stream << peer << std::fixed << std::setprecision(9) << " " << calibration.skew
+               << " " << calibration.latency << "\n";
+    }
+
+}
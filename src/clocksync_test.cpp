@@ -0,0 +1,148 @@
+// Clock model simulations: a peer clock with a known offset and drift,
+// sync rounds over a simulated link, and the model's estimate after
+// ten minutes of pings five times a second. Also how offset corrections
+// are slewed into the playout mapping.
+
+#include "clocksync.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+using namespace PianoConnect;
+using namespace std;
+
+const double BASE = 1e5;
+const double OFFSET = 12.345;
+const double SKEW = 40e-6;
+const int NUM_ROUNDS = 3000;
+const double INTERVAL = 0.2;
+// Each simulation runs with this many random seeds.
+const int NUM_RUNS = 10;
+
+int num_failed = 0;
+
+void check(bool condition, const char* what) {
+    cout << (condition ? "  ok: " : "  FAILED: ") << what << endl;
+    if(!condition) num_failed += 1;
+}
+
+double remoteAt(double local) {
+    return local + OFFSET + SKEW * (local - BASE);
+}
+
+double uniform(double low, double high) {
+    return low + (high - low) * rand() / RAND_MAX;
+}
+
+// Drift with jittery, roughly symmetric round trips.
+void simulateDrift() {
+    cout << "Drift of " << SKEW * 1e6 << " ppm, 2-3 ms round trips, +-0.5 ms asymmetry:" << endl;
+    double skew_sum = 0, skew_max = 0, offset_sum = 0, offset_max = 0;
+    for(int run = 0; run < NUM_RUNS; run++) {
+        srand(run + 1);
+        ClockModel model;
+        for(int i = 0; i < NUM_ROUNDS; i++) {
+            double t = BASE + i * INTERVAL;
+            double rtt = uniform(0.002, 0.003);
+            double asymmetry = uniform(-0.0005, 0.0005);
+            model.feed(t, remoteAt(t + rtt / 2 + asymmetry), t + rtt);
+        }
+        double t = BASE + NUM_ROUNDS * INTERVAL;
+        double skew_error = fabs(model.skew() - SKEW) * 1e6;
+        double offset_error = fabs(model.offsetAt(t) - (remoteAt(t) - t)) * 1e6;
+        skew_sum += skew_error;
+        offset_sum += offset_error;
+        skew_max = max(skew_max, skew_error);
+        offset_max = max(offset_max, offset_error);
+    }
+    cout << "  skew error " << skew_sum / NUM_RUNS << " ppm average, " << skew_max << " maximum" << endl;
+    cout << "  offset error " << offset_sum / NUM_RUNS << " us average, " << offset_max << " maximum" << endl;
+    check(skew_max < 0.5, "skew within 0.5 ppm");
+    check(offset_max < 100, "offset within 100 us");
+}
+
+// The fit without the clock filter: every round, weighted by 1 / rtt^2.
+class UnfilteredFit {
+public:
+
+    UnfilteredFit() : sw(0), sx(0), sy(0), sxx(0), sxy(0) { }
+
+    void feed(double local_sent, double remote, double local_received) {
+        double rtt = local_received - local_sent;
+        double x = (local_sent + local_received) / 2 - BASE;
+        double y = remote - (local_sent + local_received) / 2;
+        double w = 1.0 / (rtt * rtt);
+        sw += w; sx += w * x; sy += w * y; sxx += w * x * x; sxy += w * x * y;
+    }
+
+    double offsetAt(double t) const {
+        double mx = sx / sw, my = sy / sw;
+        double slope = (sxy - sw * mx * my) / (sxx - sw * mx * mx);
+        return my + slope * (t - BASE - mx);
+    }
+
+private:
+    double sw, sx, sy, sxx, sxy;
+};
+
+// Two rounds in three queue for up to 10ms, on the way out only.
+void simulateQueueing() {
+    cout << "Queueing of up to 10 ms on one path, two rounds in three:" << endl;
+    double filtered_sum = 0, filtered_max = 0, unfiltered_sum = 0;
+    for(int run = 0; run < NUM_RUNS; run++) {
+        srand(run + 1);
+        ClockModel model;
+        UnfilteredFit unfiltered;
+        for(int i = 0; i < NUM_ROUNDS; i++) {
+            double t = BASE + i * INTERVAL;
+            double queued = (rand() % 3) ? uniform(0, 0.01) : 0;
+            double remote = remoteAt(t + 0.001 + queued);
+            model.feed(t, remote, t + 0.002 + queued);
+            unfiltered.feed(t, remote, t + 0.002 + queued);
+        }
+        double t = BASE + NUM_ROUNDS * INTERVAL;
+        double truth = remoteAt(t) - t;
+        double filtered_error = fabs(model.offsetAt(t) - truth) * 1e6;
+        filtered_sum += filtered_error;
+        filtered_max = max(filtered_max, filtered_error);
+        unfiltered_sum += fabs(unfiltered.offsetAt(t) - truth) * 1e6;
+    }
+    cout << "  offset error " << unfiltered_sum / NUM_RUNS << " us unfiltered, " << filtered_sum / NUM_RUNS
+         << " us filtered, " << filtered_max << " us maximum" << endl;
+    check(filtered_sum < unfiltered_sum / 4, "filter cuts the offset error at least fourfold");
+    check(filtered_max < 50, "filtered offset within 50 us");
+}
+
+// A 2ms correction is worked off at no more than 1ms/s, a 200ms one is
+// applied at once.
+void simulateSlew() {
+    cout << "Offset slew of a 2 ms correction:" << endl;
+    OffsetSlew slew(1.0);
+    double t = BASE;
+    slew.residual(t);
+    slew.correct(t, 0.002);
+    double previous = slew.residual(t), fastest = 0, at_one = 0;
+    for(int i = 1; i <= 1000; i++) {
+        t = BASE + i * 0.01;
+        double residual = slew.residual(t);
+        fastest = max(fastest, fabs(residual - previous) / 0.01);
+        previous = residual;
+        if(i == 100) at_one = residual;
+    }
+    cout << "  residual " << -at_one * 1e6 << " us after 1 s, " << -previous * 1e6 << " us after 10 s, fastest "
+         << fastest * 1e3 << " ms/s" << endl;
+    check(fastest <= 1e-3 + 1e-9, "never faster than 1 ms/s");
+    check(fabs(previous) < 1e-6, "worked off within 10 s");
+    slew.correct(t, 0.2);
+    check(slew.residual(t) == 0, "200 ms correction applied at once");
+}
+
+int main() {
+    simulateDrift();
+    simulateQueueing();
+    simulateSlew();
+    cout << (num_failed == 0 ? "All passed." : "Failures.") << endl;
+    return num_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+#include "dispatch.h"
+#include "timer.h"
+#include "realtime.h"
+
+namespace PianoConnect {
+
+    OutputDispatcher::OutputDispatcher(boost::shared_ptr<MIDIDevice> device_, bool scheduled_) {
+        device = device_;
+        scheduled = scheduled_;
+        waiting.store(false);
+        max_depth.store(0);
+        dropped.store(0);
+        should_stop = false;
+        ThreadInfo thread_info;
+        thread_info.self = this;
+        thread = boost::thread(thread_info);
+    }
+
+    OutputDispatcher::~OutputDispatcher() {
+        {
+            boost::lock_guard<boost::mutex> guard(mutex);
+            should_stop = true;
+            condition.notify_one();
+        }
+        thread.join();
+    }
+
+    void OutputDispatcher::post(const MIDIMessage& message) {
+        if(!queue.push(message)) {
+            dropped.fetch_add(1, boost::memory_order_relaxed);
+            return;
+        }
+        unsigned int depth = queue.size();
+        if(depth > max_depth.load(boost::memory_order_relaxed)) {
+            max_depth.store(depth, boost::memory_order_relaxed);
+        }
+        // Pairs with the fence in worker_thread: either we see the worker
+        // waiting, or the worker sees the message.
+        boost::atomic_thread_fence(boost::memory_order_seq_cst);
+        if(waiting.load(boost::memory_order_relaxed)) {
+            boost::lock_guard<boost::mutex> guard(mutex);
+            condition.notify_one();
+        }
+    }
+
+    OutputStatistics OutputDispatcher::statistics() {
+        OutputStatistics result;
+        result.depth = queue.size();
+        result.max_depth = max_depth.exchange(0, boost::memory_order_relaxed);
+        result.dropped = dropped.load(boost::memory_order_relaxed);
+        boost::lock_guard<boost::mutex> guard(mutex);
+        result.lateness = lateness;
+        lateness.reset();
+        return result;
+    }
+
+    void OutputDispatcher::worker_thread() {
+        applyThreadPolicy("output");
+        MIDIMessage message;
+        PhaseStatistics batch_lateness;
+        for(;;) {
+            // Everything queued so far goes to the driver as one batch.
+            if(queue.pop(message)) {
+                device->beginBatch();
+                do {
+                    if(scheduled) {
+                        device->appendMessageAt(message.timestamp, message.message, message.length);
+                    } else {
+                        device->appendMessage(message.message, message.length);
+                    }
+                    batch_lateness.feed(precise_time() - message.timestamp);
+                } while(queue.pop(message));
+                device->flushBatch();
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            lateness.merge(batch_lateness);
+            batch_lateness.reset();
+            waiting.store(true, boost::memory_order_relaxed);
+            boost::atomic_thread_fence(boost::memory_order_seq_cst);
+            while(queue.empty() && !should_stop) {
+                condition.wait(lock);
+            }
+            waiting.store(false, boost::memory_order_relaxed);
+            if(should_stop) break;
+        }
+    }
+
+}
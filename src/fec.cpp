@@ -0,0 +1,128 @@
+#include "fec.h"
+#include "wire.h"
+
+#include <cstring>
+
+namespace PianoConnect {
+
+namespace {
+
+    void xorInto(unsigned char* parity, const MIDIMessage& message) {
+        unsigned char record[MIDI_RECORD_SIZE];
+        encodeRecord(message, record);
+        for(int i = 0; i < MIDI_RECORD_SIZE; i++) parity[i] ^= record[i];
+    }
+
+}
+
+    ParityEncoder::ParityEncoder(int group_size_, double window_) {
+        window = window_;
+        num_parity = 0;
+        group_started = 0;
+        memset(&group, 0, sizeof(group));
+        setGroupSize(group_size_);
+    }
+
+    void ParityEncoder::setGroupSize(int group_size_) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        group_size = group_size_ < 1 ? 1 : (group_size_ > FEC_MAX_GROUP ? FEC_MAX_GROUP : group_size_);
+    }
+
+    bool ParityEncoder::add(double now, const Packet_MIDIMessage& packet, Packet_Parity& parity) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        if(group.count == 0) {
+            group.session = packet.identifier.session;
+            group.first_serial = packet.identifier.serial;
+            group_started = now;
+        }
+        xorInto(group.parity, packet.message);
+        group.count += 1;
+        if(group.count < group_size) return false;
+        close(parity);
+        return true;
+    }
+
+    bool ParityEncoder::flush(double now, Packet_Parity& parity) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        if(group.count == 0 || now < group_started + window) return false;
+        close(parity);
+        return true;
+    }
+
+    double ParityEncoder::deadline() {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        return group.count > 0 ? group_started + window : DEADLINE_NONE;
+    }
+
+    int ParityEncoder::numParity() {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        return num_parity;
+    }
+
+    void ParityEncoder::close(Packet_Parity& parity) {
+        parity = group;
+        parity.type = PACKET_Parity;
+        num_parity += 1;
+        memset(&group, 0, sizeof(group));
+    }
+
+    ParityDecoder::ParityDecoder() {
+        for(int i = 0; i < HISTORY; i++) history[i].valid = false;
+        num_recovered = 0;
+        num_unrecoverable = 0;
+    }
+
+    void ParityDecoder::received(const Packet_MIDIMessage& packet) {
+        Entry& entry = history[packet.identifier.serial % HISTORY];
+        entry.valid = true;
+        entry.exact = true;
+        entry.packet = packet;
+    }
+
+    void ParityDecoder::repaired(const Packet_MIDIMessage& packet) {
+        received(packet);
+        history[packet.identifier.serial % HISTORY].exact = false;
+    }
+
+    const ParityDecoder::Entry* ParityDecoder::find(unsigned int session, unsigned int serial) const {
+        const Entry& entry = history[serial % HISTORY];
+        if(!entry.valid || entry.packet.identifier.session != session || entry.packet.identifier.serial != serial) return NULL;
+        return &entry;
+    }
+
+    bool ParityDecoder::recover(const Packet_Parity& parity, Packet_MIDIMessage& recovered) {
+        if(parity.count < 1 || parity.count > FEC_MAX_GROUP) return false;
+        unsigned char record[MIDI_RECORD_SIZE];
+        memcpy(record, parity.parity, MIDI_RECORD_SIZE);
+        int missing = 0;
+        unsigned int missing_serial = 0;
+        bool exact = true;
+        for(int i = 0; i < parity.count; i++) {
+            const Entry* entry = find(parity.session, parity.first_serial + i);
+            if(entry) {
+                xorInto(record, entry->packet.message);
+                exact = exact && entry->exact;
+            } else {
+                missing += 1;
+                missing_serial = parity.first_serial + i;
+            }
+        }
+        if(missing == 0) return false;
+        if(missing > 1) {
+            num_unrecoverable += 1;
+            return false;
+        }
+        // A timestamp a microsecond off can flip any bit of the rebuilt one.
+        if(!exact) return false;
+        memset(&recovered, 0, sizeof(recovered));
+        recovered.type = PACKET_MIDIMessage;
+        decodeRecord(record, recovered.message);
+        recovered.identifier.session = parity.session;
+        recovered.identifier.serial = missing_serial;
+        recovered.identifier.timestamp = recovered.message.timestamp;
+        received(recovered);
+        num_recovered += 1;
+        return true;
+    }
+
+}
@@ -0,0 +1,76 @@
+#include "jitterbuffer.h"
+
+#include <algorithm>
+
+namespace PianoConnect {
+
+    // Shrinking: exponential approach with this time constant, and at most
+    // this many seconds of delay per second.
+    const double SHRINK_TIME_CONSTANT = 10.0;
+    const double SHRINK_MAX_RATE = 0.001;
+
+    JitterBuffer::JitterBuffer(double percentile_, double margin_) {
+        percentile = percentile_;
+        margin = margin_;
+        target_delay = 0;
+        current_delay = 0;
+        last_update = 0;
+        arrivals = 0;
+    }
+
+    void JitterBuffer::feed(double delay) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        window.feed(delay);
+        // Don't wait for the next update to grow.
+        if(delay + margin > current_delay) updateLocked(last_update);
+    }
+
+    void JitterBuffer::seed(double delay) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        target_delay = delay;
+        current_delay = delay;
+    }
+
+    void JitterBuffer::update(double now) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        updateLocked(now);
+    }
+
+    void JitterBuffer::updateLocked(double now) {
+        if(window.empty()) return;
+        target_delay = window.percentile(percentile) + margin;
+
+        double dt = last_update > 0 ? now - last_update : 0;
+        if(now > last_update) last_update = now;
+        if(target_delay >= current_delay) {
+            current_delay = target_delay;
+        } else if(dt > 0) {
+            double step = (current_delay - target_delay) * std::min(1.0, dt / SHRINK_TIME_CONSTANT);
+            current_delay -= std::min(step, SHRINK_MAX_RATE * dt);
+        }
+    }
+
+    void JitterBuffer::arrived(double arrival, double playout) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        arrivals += 1;
+        if(arrival > playout) late.feed(arrival - playout);
+    }
+
+    double JitterBuffer::delay() {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        return current_delay;
+    }
+
+    JitterStatistics JitterBuffer::statistics() {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        JitterStatistics result;
+        result.target = target_delay;
+        result.delay = current_delay;
+        result.arrivals = arrivals;
+        result.late = late;
+        arrivals = 0;
+        late.reset();
+        return result;
+    }
+
+}
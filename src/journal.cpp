@@ -0,0 +1,52 @@
+#include "journal.h"
+
+#include <cstring>
+
+namespace PianoConnect {
+
+    RecoveryJournal::RecoveryJournal(int size_) {
+        count = 0;
+        next = 0;
+        setSize(size_);
+    }
+
+    void RecoveryJournal::setSize(int size_) {
+        size = size_ < 1 ? 1 : (size_ > JOURNAL_MAX_SIZE ? JOURNAL_MAX_SIZE : size_);
+        count = 0;
+        next = 0;
+    }
+
+    int RecoveryJournal::write(double timestamp, JournalEntry* entries) const {
+        for(int i = 0; i < count; i++) {
+            const Item& item = items[(next - count + i + size) % size];
+            JournalEntry& entry = entries[i];
+            entry.serial = item.serial;
+            entry.age = (float)(timestamp - item.timestamp);
+            entry.length = (unsigned char)item.length;
+            memset(entry.message, 0, sizeof(entry.message));
+            memcpy(entry.message, item.message, item.length);
+        }
+        return count;
+    }
+
+    void RecoveryJournal::add(unsigned int serial, double timestamp, const unsigned char* message, int length) {
+        // Channel messages only, status bytes 0x80 to 0xEF.
+        if(length < 1 || length > 3 || message[0] < 0x80 || message[0] >= 0xF0) return;
+        Item& item = items[next];
+        item.serial = serial;
+        item.timestamp = timestamp;
+        item.length = length;
+        memcpy(item.message, message, length);
+        next = (next + 1) % size;
+        if(count < size) count += 1;
+    }
+
+    bool journalRecoverable(const JournalEntry& entry, double max_note_age) {
+        if(entry.length < 1 || entry.length > 3) return false;
+        bool note_on = (entry.message[0] & 0xF0) == 0x90 && entry.length == 3 && entry.message[2] > 0;
+        // A note-on this late would sound out of place, its note-off still counts.
+        if(note_on) return entry.age <= max_note_age;
+        return true;
+    }
+
+}
@@ -1,11 +1,24 @@
 #include "midi.h"
+#include "timer.h"
+#include "realtime.h"
 #include "RtMidi.h"
 
 namespace PianoConnect {
 
 namespace {
 
-    void MIDIDevice_RtMidiIn_callback(double timeStamp, std::vector< unsigned char > *message, void *userData);
+    // Driver queues run on the kernel timer: re-anchor precise_time() =
+    // queue time + queue_offset as the clocks drift apart.
+    template < class Device >
+    void synchronizeQueue(Device* device, double& queue_offset, double& last_sync) {
+        double before = precise_time();
+        double queue_time = device->getQueueTime();
+        double after = precise_time();
+        queue_offset = (before + after) / 2 - queue_time;
+        last_sync = after;
+    }
+
+    void MIDIDevice_RtMidiIn_callback(double, std::vector< unsigned char > *message, void *userData);
 
     class MIDIDevice_RtMidiIn : public MIDIDevice {
     public:
@@ -13,8 +26,25 @@ namespace {
         MIDIDevice_RtMidiIn(int index) {
             device = new RtMidiIn();
             device->openPort(index);
-            device->setCallback(MIDIDevice_RtMidiIn_callback, this);
             delegate = NULL;
+            thread_policy_applied = false;
+            synchronizeQueue(device, queue_offset, last_sync);
+            device->setCallback(MIDIDevice_RtMidiIn_callback, this);
+        }
+
+        // Arrival time of the message in the callback, in precise_time() seconds.
+        double eventTime() {
+            double now = precise_time();
+            double event_time = device->getEventTime();
+            if(event_time < 0) return now;
+            if(now - last_sync > 1.0) synchronizeQueue(device, queue_offset, last_sync);
+            double t = event_time + queue_offset;
+            if(t < now - 1.0) {
+                // The queue was restarted or the mapping is off.
+                last_sync = 0;
+                return now;
+            }
+            return t < now ? t : now;
         }
 
         virtual void sendMessage(const void* message, int length) { }
@@ -29,12 +59,20 @@ namespace {
 
         RtMidiIn* device;
         Delegate* delegate;
+        // The driver owns the callback thread, set its policy on first use.
+        bool thread_policy_applied;
+        // precise_time() = event time + queue_offset, as of last_sync.
+        double queue_offset, last_sync;
 
     };
 
-    void MIDIDevice_RtMidiIn_callback(double timeStamp, std::vector< unsigned char > *message, void *userData) {
+    void MIDIDevice_RtMidiIn_callback(double, std::vector< unsigned char > *message, void *userData) {
         MIDIDevice_RtMidiIn* self = (MIDIDevice_RtMidiIn*)userData;
-        self->delegate->onMessage(timeStamp, &(*message)[0], message->size());
+        if(!self->thread_policy_applied) {
+            applyThreadPolicy("midi-input");
+            self->thread_policy_applied = true;
+        }
+        self->delegate->onMessage(self->eventTime(), &(*message)[0], message->size());
     }
 
     class MIDIDevice_RtMidiOut : public MIDIDevice {
@@ -42,21 +80,61 @@ namespace {
 
         RtMidiOut* device;
 
+        // Set when the driver's sequencer queue schedules our messages.
+        bool scheduling;
+        // precise_time() = queue time + queue_offset, as of last_sync.
+        double queue_offset, last_sync;
+
         MIDIDevice_RtMidiOut(int index) {
             device = new RtMidiOut();
             device->openPort(index);
+            scheduling = false;
         }
 
         MIDIDevice_RtMidiOut(const std::string& name) {
             device = new RtMidiOut();
             device->openVirtualPort(name);
+            scheduling = false;
         }
 
         virtual void sendMessage(const void* message, int length) {
-            const unsigned char* msg = (const unsigned char*)message;
-            std::vector< unsigned char > vm(msg, msg + length);
-            device->sendMessage(&vm);
+            device->sendMessage((const unsigned char*)message, length);
+        }
+
+        virtual bool enableScheduling() {
+            if(!device->startQueue()) return false;
+            synchronizeQueue(device, queue_offset, last_sync);
+            scheduling = true;
+            return true;
+        }
+
+        virtual void sendMessageAt(double time, const void* message, int length) {
+            if(!scheduling) {
+                sendMessage(message, length);
+                return;
+            }
+            if(precise_time() - last_sync > 1.0) synchronizeQueue(device, queue_offset, last_sync);
+            device->sendMessageAt(time - queue_offset, (const unsigned char*)message, length);
+        }
+
+        virtual void beginBatch() {
+            if(scheduling && precise_time() - last_sync > 1.0) synchronizeQueue(device, queue_offset, last_sync);
+        }
+
+        virtual void appendMessage(const void* message, int length) {
+            device->bufferMessage((const unsigned char*)message, length);
+        }
+
+        virtual void appendMessageAt(double time, const void* message, int length) {
+            if(!scheduling) {
+                appendMessage(message, length);
+                return;
+            }
+            device->bufferMessageAt(time - queue_offset, (const unsigned char*)message, length);
+        }
 
+        virtual void flushBatch() {
+            device->flushMessages();
         }
 
         virtual void setDelegate(Delegate* delegate) { }
@@ -1,4 +1,5 @@
 #include "networking.h"
+#include "realtime.h"
 #include <iostream>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
@@ -7,6 +8,12 @@
 
 #include <openssl/hmac.h>
 
+#ifdef PLATFORM_LINUX
+#include <sys/socket.h>
+#include <time.h>
+#include <errno.h>
+#endif
+
 using boost::asio::ip::udp;
 using boost::asio::ip::tcp;
 
@@ -28,6 +35,58 @@ namespace {
         return *resolver.resolve(query);
     }
 
+    // Ask the kernel to stamp incoming datagrams (SO_TIMESTAMPNS).
+    void enableReceiveTimestamps(udp::socket& socket) {
+    #ifdef PLATFORM_LINUX
+        int on = 1;
+        setsockopt(socket.native_handle(), SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    #endif
+    }
+
+    // Receive a datagram along with its arrival time in precise_time() seconds.
+    // Throws like receive_from() when the socket is closed.
+    size_t receiveTimestamped(udp::socket& socket, void* buffer, size_t size, udp::endpoint& sender, double& timestamp) {
+    #ifdef PLATFORM_LINUX
+        iovec iov;
+        iov.iov_base = buffer;
+        iov.iov_len = size;
+        char control[CMSG_SPACE(sizeof(timespec))];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t length;
+        do {
+            msg.msg_name = sender.data();
+            msg.msg_namelen = sender.capacity();
+            length = recvmsg(socket.native_handle(), &msg, 0);
+        } while(length < 0 && errno == EINTR);
+        if(length < 0) {
+            throw boost::system::system_error(boost::system::error_code(errno, boost::system::system_category()));
+        }
+        timestamp = precise_time();
+        timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        sender.resize(msg.msg_namelen);
+        // The stamp is wall clock time, carry its age over to our clock.
+        for(cmsghdr* c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+            if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+                timespec arrival;
+                memcpy(&arrival, CMSG_DATA(c), sizeof(arrival));
+                double age = (wall.tv_sec - arrival.tv_sec) + (wall.tv_nsec - arrival.tv_nsec) * 1e-9;
+                if(age >= 0 && age < 1.0) timestamp -= age;
+            }
+        }
+        return length;
+    #else
+        size_t length = socket.receive_from(boost::asio::buffer(buffer, size), sender);
+        timestamp = precise_time();
+        return length;
+    #endif
+    }
+
     class NetworkConnection_UDP : public NetworkConnection {
     public:
 
@@ -35,13 +94,15 @@ namespace {
             NetworkConnection_UDP* self;
 
             void operator () () {
+                applyThreadPolicy("network");
                 unsigned char buffer[4096];
                 udp::endpoint sender_endpoint;
                 while(1) {
                     try {
-                        size_t len = self->socket.receive_from(boost::asio::buffer(buffer, 4096), sender_endpoint);
+                        double timestamp;
+                        size_t len = receiveTimestamped(self->socket, buffer, 4096, sender_endpoint, timestamp);
                         if(self->delegate) {
-                            self->delegate->onPacket(buffer, len);
+                            self->delegate->onPacketReceived(timestamp, buffer, len);
                         }
                     } catch(...) {
                         break;
@@ -59,6 +120,7 @@ namespace {
 
             socket.open(endpoint_listen.protocol());
             socket.bind(endpoint_listen);
+            enableReceiveTimestamps(socket);
 
             ListenThread t;
             t.self = this;
@@ -92,15 +154,17 @@ namespace {
             NetworkConnection_UDPServer* self;
 
             void operator () () {
+                applyThreadPolicy("network");
                 unsigned char buffer[4096];
                 udp::endpoint sender_endpoint;
                 while(1) {
                     try {
-                        size_t len = self->socket.receive_from(boost::asio::buffer(buffer, 4096), sender_endpoint);
+                        double timestamp;
+                        size_t len = receiveTimestamped(self->socket, buffer, 4096, sender_endpoint, timestamp);
                         self->endpoint_client = sender_endpoint;
                         self->endpoint_client_available = true;
                         if(self->delegate) {
-                            self->delegate->onPacket(buffer, len);
+                            self->delegate->onPacketReceived(timestamp, buffer, len);
                         }
                     } catch(...) {
                         break;
@@ -118,6 +182,7 @@ namespace {
 
             socket.open(endpoint_bind.protocol());
             socket.bind(endpoint_bind);
+            enableReceiveTimestamps(socket);
 
             ListenThread t;
             t.self = this;
@@ -153,13 +218,15 @@ namespace {
             NetworkConnection_UDPClient* self;
 
             void operator () () {
+                applyThreadPolicy("network");
                 unsigned char buffer[4096];
                 udp::endpoint sender_endpoint;
                 while(1) {
                     try {
-                        size_t len = self->socket.receive_from(boost::asio::buffer(buffer, 4096), sender_endpoint);
+                        double timestamp;
+                        size_t len = receiveTimestamped(self->socket, buffer, 4096, sender_endpoint, timestamp);
                         if(self->delegate) {
-                            self->delegate->onPacket(buffer, len);
+                            self->delegate->onPacketReceived(timestamp, buffer, len);
                         }
                     } catch(...) {
                         break;
@@ -175,6 +242,7 @@ namespace {
             endpoint_connect = resolveEndpoint(connect);
 
             socket.open(endpoint_connect.protocol());
+            enableReceiveTimestamps(socket);
 
             ListenThread t;
             t.self = this;
@@ -207,6 +275,7 @@ namespace {
             NetworkConnection_TCPServerClient* self;
 
             void operator () () {
+                applyThreadPolicy("network");
                 unsigned char buffer[4096];
                 boost::system::error_code error;
                 while(1) {
@@ -310,14 +379,19 @@ namespace {
             connection->send(&new_packet[0], size + HMAC_LENGTH);
         }
 
-        virtual void onPacket(const void* packet_, int size) {
+        virtual void onPacket(const void* packet, int size) {
+            onPacketReceived(precise_time(), packet, size);
+        }
+
+        // Keeps the arrival time, verification is not counted in it.
+        virtual void onPacketReceived(double timestamp, const void* packet_, int size) {
             if(delegate && size >= HMAC_LENGTH) {
                 const unsigned char* packet = (const unsigned char*)packet_;
                 unsigned char digest[HMAC_LENGTH];
                 unsigned int digest_length = HMAC_LENGTH;
                 HMAC(EVP_sha1(), key.c_str(), key.size(), packet, size - HMAC_LENGTH, digest, &digest_length);
                 if(memcmp(digest, packet + size - HMAC_LENGTH, HMAC_LENGTH) == 0) {
-                    delegate->onPacket(packet, size - HMAC_LENGTH);
+                    delegate->onPacketReceived(timestamp, packet, size - HMAC_LENGTH);
                 }
             }
         }
@@ -0,0 +1,210 @@
+// Output path benchmark: heap allocations and time per message, and the
+// spread between the first and last note of a chord as delivered.
+// Usage: output_benchmark [output-device-index input-device-index], default
+// is a virtual port read back through the sequencer. Given devices, the
+// output must be looped back to the input (e.g. snd-virmidi, aconnect).
+
+#include "midi.h"
+#include "dispatch.h"
+#include "timer.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <new>
+
+#include <boost/atomic.hpp>
+
+using namespace PianoConnect;
+using namespace std;
+
+boost::atomic<long> num_allocations(0);
+
+void* operator new(size_t size) {
+    num_allocations.fetch_add(1, boost::memory_order_relaxed);
+    void* p = malloc(size);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) throw() {
+    free(p);
+}
+
+void* operator new[](size_t size) {
+    num_allocations.fetch_add(1, boost::memory_order_relaxed);
+    void* p = malloc(size);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete[](void* p) throw() {
+    free(p);
+}
+
+const int NUM_MESSAGES = 10000;
+const int NUM_CHORDS = 1000;
+const int CHORD_SIZE = 10;
+
+MIDIMessage note(int i) {
+    MIDIMessage msg;
+    msg.length = 3;
+    msg.timestamp = precise_time();
+    msg.message[0] = (i & 1) ? 0x80 : 0x90;
+    msg.message[1] = 60 + (i / 2) % 12;
+    msg.message[2] = 64;
+    return msg;
+}
+
+void report(const char* name, long allocations) {
+    cout << name << ": " << (double)allocations / NUM_MESSAGES << " allocations/message" << endl;
+}
+
+// Delivery times of the looped back notes of one chord, stamped by the
+// input driver.
+class Loopback : public MIDIDevice::Delegate {
+public:
+
+    Loopback() : count(0) { }
+
+    virtual void onMessage(double timestamp, const void*, int) {
+        int i = count.load();
+        if(i < CHORD_SIZE) times[i] = timestamp;
+        count.store(i + 1);
+    }
+
+    // False if the chord didn't come back within 100ms.
+    bool wait() {
+        double deadline = precise_time() + 0.1;
+        while(count.load() < CHORD_SIZE) {
+            if(precise_time() > deadline) return false;
+            sleep(0.0005);
+        }
+        return true;
+    }
+
+    void reset() {
+        count.store(0);
+    }
+
+    double spread() const {
+        return times[CHORD_SIZE - 1] - times[0];
+    }
+
+    double times[CHORD_SIZE];
+    boost::atomic<int> count;
+};
+
+struct Spread {
+    Spread() : handoff(0), delivered(0), delivered_max(0), chords(0), lost(0) { }
+    double handoff, delivered, delivered_max;
+    int chords, lost;
+
+    void print(const char* name) const {
+        cout << "  " << name << handoff / NUM_CHORDS * 1e6 << " us hand-off";
+        if(chords > 0) {
+            cout << ", delivered " << delivered / chords * 1e6 << " us average, " << delivered_max * 1e6 << " us maximum";
+        }
+        if(lost > 0) cout << ", " << lost << " chords lost";
+        cout << endl;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    MIDIManager* manager = MIDIManager::CreateRtMidi();
+    boost::shared_ptr<MIDIDevice> device, input;
+    Loopback loopback;
+    if(argc > 2) {
+        device.reset(manager->openOutDevice(atoi(argv[1])));
+        input.reset(manager->openInDevice(atoi(argv[2])));
+    } else {
+        device.reset(manager->createVirtualPort("PianoConnect Benchmark"));
+        // Our virtual port shows up among the inputs.
+        std::vector<std::string> inputs = manager->listInDevices();
+        for(size_t i = 0; i < inputs.size(); i++) {
+            if(inputs[i].find("PianoConnect Benchmark") != std::string::npos) {
+                input.reset(manager->openInDevice(i));
+                break;
+            }
+        }
+    }
+    if(input) {
+        input->setDelegate(&loopback);
+    } else {
+        cout << "No loopback input, delivered chord spread not measured." << endl;
+    }
+
+    // Direct: MIDIDevice::sendMessage.
+    for(int i = 0; i < 100; i++) {
+        MIDIMessage msg = note(i);
+        device->sendMessage(msg.message, msg.length);
+    }
+    long a0 = num_allocations.load();
+    double t0 = precise_time();
+    for(int i = 0; i < NUM_MESSAGES; i++) {
+        MIDIMessage msg = note(i);
+        device->sendMessage(msg.message, msg.length);
+    }
+    double t1 = precise_time();
+    report("MIDIDevice::sendMessage", num_allocations.load() - a0);
+    cout << "  " << (t1 - t0) / NUM_MESSAGES * 1e6 << " us/message" << endl;
+
+    // Through the per-device dispatcher, as the playback thread does.
+    {
+        OutputDispatcher dispatcher(device, false);
+        for(int i = 0; i < 100; i++) dispatcher.post(note(i));
+        sleep(0.1);
+        a0 = num_allocations.load();
+        for(int i = 0; i < NUM_MESSAGES; i++) {
+            dispatcher.post(note(i));
+            // Let the worker keep up, the queue holds 256 messages.
+            if(i % 64 == 63) sleep(0.002);
+        }
+        sleep(0.1);
+        report("OutputDispatcher::post", num_allocations.load() - a0);
+        OutputStatistics stats = dispatcher.statistics();
+        cout << "  dropped: " << stats.dropped << endl;
+    }
+
+    // Chord spread, one drain per note vs one per batch: time to hand the
+    // chord to the driver, and the gap between the first and last note as
+    // they come back on the loopback input.
+    {
+        MIDIMessage chord[CHORD_SIZE];
+        for(int i = 0; i < CHORD_SIZE; i++) chord[i] = note(2 * i);
+        Spread unbatched, batched;
+        for(int c = 0; c < NUM_CHORDS; c++) {
+            for(int batch = 0; batch < 2; batch++) {
+                Spread& spread = batch ? batched : unbatched;
+                loopback.reset();
+                double s0 = precise_time();
+                if(batch) {
+                    device->beginBatch();
+                    for(int i = 0; i < CHORD_SIZE; i++) device->appendMessage(chord[i].message, chord[i].length);
+                    device->flushBatch();
+                } else {
+                    for(int i = 0; i < CHORD_SIZE; i++) device->sendMessage(chord[i].message, chord[i].length);
+                }
+                spread.handoff += precise_time() - s0;
+                if(!input) continue;
+                if(!loopback.wait()) {
+                    spread.lost += 1;
+                    continue;
+                }
+                double delivered = loopback.spread();
+                spread.delivered += delivered;
+                if(delivered > spread.delivered_max) spread.delivered_max = delivered;
+                spread.chords += 1;
+                // Let the sequencer settle before the next chord.
+                sleep(0.001);
+            }
+        }
+        cout << "Chord spread (" << CHORD_SIZE << " notes):" << endl;
+        unbatched.print("sendMessage: ");
+        batched.print("batch:       ");
+    }
+
+    device.reset();
+    delete manager;
+}
@@ -5,11 +5,14 @@
 #include "pianoconnect.h"
 #include "protocol.h"
 #include "timer.h"
+#include "realtime.h"
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include <string>
 #include <cstdlib>
+#include <cmath>
 
 #include <boost/algorithm/string/case_conv.hpp>
 #include <boost/algorithm/string/trim.hpp>
@@ -36,7 +39,16 @@ namespace PianoConnect {
         latency = 0;
         input_ask = false;
         output_ask = false;
+        scheduled_output = false;
         duplication = 1;
+        fec = 0;
+        journal = 0;
+        bundle_window = 0;
+        piggyback_sync = false;
+        slew_window = 1.0;
+        clock_source = CLOCK_SOURCE_MONOTONIC;
+        realtime_priority = 0;
+        lock_memory = false;
 
         std::string line;
         while(std::getline(stream, line)) {
@@ -53,6 +65,12 @@ namespace PianoConnect {
 
             if(args[0] == "log" && args.size() == 2) {
                 log_file = args[1];
+            } else if(args[0] == "piggyback-sync" && args.size() == 1) {
+                piggyback_sync = true;
+            } else if(args[0] == "slew-window" && args.size() == 2) {
+                slew_window = atof(args[1].c_str()) / 1000.0;
+            } else if(args[0] == "sync-cache" && args.size() == 2) {
+                sync_cache = args[1];
             } else if(args[0] == "hmac" && args.size() == 2) {
                 hmac_key = args[1];
             } else if(args[0] == "input" && args.size() == 2) {
@@ -63,10 +81,27 @@ namespace PianoConnect {
                 input_ask = true;
             } else if(args[0] == "output-ask" && args.size() == 1) {
                 output_ask = true;
+            } else if(args[0] == "scheduled-output" && args.size() == 1) {
+                scheduled_output = true;
+            } else if(args[0] == "clock" && args.size() == 2) {
+                if(!parseClockSource(args[1], clock_source)) throw std::invalid_argument("Error reading configuration file: unknown clock '" + args[1] + "'.");
+            } else if(args[0] == "realtime-priority" && args.size() == 2) {
+                realtime_priority = atoi(args[1].c_str());
+            } else if(args[0] == "cpu-affinity" && args.size() == 3) {
+                if(!isThreadName(args[1])) throw std::invalid_argument("Error reading configuration file: unknown thread '" + args[1] + "'.");
+                cpu_affinity.push_back(std::make_pair(args[1], atoi(args[2].c_str())));
+            } else if(args[0] == "mlock" && args.size() == 2) {
+                lock_memory = (args[1] == "yes");
             } else if(args[0] == "port" && args.size() == 2) {
                 ports.push_back(args[1]);
             } else if(args[0] == "duplication" && args.size() == 2) {
                 duplication = atoi(args[1].c_str());
+            } else if(args[0] == "fec" && args.size() == 2) {
+                fec = atoi(args[1].c_str());
+            } else if(args[0] == "journal" && args.size() == 2) {
+                journal = atoi(args[1].c_str());
+            } else if(args[0] == "bundle" && args.size() == 2) {
+                bundle_window = atof(args[1].c_str()) / 1000.0;
             } else if(args[0] == "latency" && args.size() == 2) {
                 latency = atof(args[1].c_str()) / 1000.0;
                 auto_latency = false;
@@ -103,52 +138,340 @@ namespace PianoConnect {
 
         num_packets = 0;
         num_midi_messages = 0;
+        num_dropped.store(0);
+        num_outgoing.store(0);
+        num_repaired = 0;
+        num_unsynced = 0;
+        receiving_bundle = false;
+        has_scheduled_output = false;
+        dispatch_batch.reserve(256);
+        // Differs between runs, so a restarted peer isn't taken for a replay.
+        boost::int64_t started = precise_time_ns();
+        current_session = (unsigned int)(started ^ (started >> 16) ^ (started >> 32) ^ (started >> 48)) & 0xFFFF;
+        current_serial = 0;
+        last_sync_ack = 0;
+        num_sync_acks = 0;
+        sync_burst.store(false);
+        echo_timestamp = 0;
+        echo_received = 0;
+        num_echo_rounds.store(0);
     }
 
     PianoConnectApplication::~PianoConnectApplication() {
     }
 
+    void PianoConnectApplication::enqueue(const MIDIMessage& message) {
+        if(incoming_messages.push(message)) {
+            // Scheduled outputs want the message right away, not at its playout time.
+            timer->wakeAt(has_scheduled_output ? precise_time() : message.timestamp);
+        } else {
+            num_dropped.fetch_add(1, boost::memory_order_relaxed);
+            cout << "Warning: playback queue full, dropped message." << endl;
+        }
+    }
+
+    // Startup burst: rounds 10ms apart, the clock filter sees them all.
+    const int SYNC_BURST_COUNT = 16;
+    const double SYNC_BURST_INTERVAL = 0.01;
+    // A peer quiet for this long is treated as reconnecting.
+    const double SYNC_SILENCE = 2.0;
+    // Messages held longer than this are not echoed.
+    const double ECHO_MAX_HOLD = 1.0;
+    // Lost note-ons older than this are not played from the journal.
+    const double JOURNAL_MAX_NOTE_AGE = 0.1;
+    // While MIDI packets carry sync rounds, pings back off up to this many ticks apart.
+    const int SYNC_MAX_INTERVAL = 10;
+    // One-way delays this far from the ping rounds' are clock or unwrap
+    // glitches; one such sample would hold the playout delay up for minutes.
+    const double JITTER_MAX_DEVIATION = 1.0;
+    // The playback thread tries again this much later when an input thread
+    // holds the send lock.
+    const double SEND_RETRY = 0.0002;
+
+    void PianoConnectApplication::sendClockSync() {
+        Packet_ClockSync packet;
+        packet.type = PACKET_ClockSync;
+        packet.timestamp_sent = precise_time();
+        packet.timestamp_ack = 0;
+        packet.timestamp_received = 0;
+        networking->send(packet);
+    }
+
+    void PianoConnectApplication::sendClockSyncBurst() {
+        for(int i = 0; i < SYNC_BURST_COUNT; i++) {
+            if(i > 0) sleep(SYNC_BURST_INTERVAL);
+            sendClockSync();
+        }
+    }
+
+    void PianoConnectApplication::onSyncRound(double now) {
+        // First answer in a while: the peer (re)connected, converge again quickly.
+        if(now - last_sync_ack > SYNC_SILENCE) sync_burst.store(true);
+        last_sync_ack = now;
+        num_sync_acks += 1;
+    }
+
+    void PianoConnectApplication::feedClock(double now, double local_sent, double remote_received, double remote_sent, double local_received) {
+        double before = clock_model.offsetAt(now);
+        clock_model.feed(local_sent, remote_received, remote_sent, local_received);
+        offset_slew.correct(now, clock_model.offsetAt(now) - before);
+    }
+
+    void PianoConnectApplication::publishClock(double now) {
+        ClockSnapshot snapshot;
+        snapshot.time = now;
+        snapshot.offset = clock_model.offsetAt(now);
+        snapshot.skew = clock_model.skew();
+        snapshot.dispersion = clock_model.dispersion();
+        snapshot.residual = offset_slew.residual(now);
+        snapshot.playout_delay = config.auto_latency ? jitter.delay() : config.latency;
+        snapshot.network_latency = latency_rs.average();
+        clock_snapshot.write(snapshot);
+    }
+
+    std::string PianoConnectApplication::peerName() const {
+        std::stringstream name;
+        if(config.connection_type == "udp") {
+            name << "udp:" << config.udp_remote.address << ":" << config.udp_remote.port;
+        } else if(config.connection_type == "udp-client" || config.connection_type == "tcp-client") {
+            name << config.connection_type << ":" << config.connect_address.address << ":" << config.connect_address.port;
+        } else {
+            name << config.connection_type << ":" << config.listen_address.address << ":" << config.listen_address.port;
+        }
+        return name.str();
+    }
+
     void PianoConnectApplication::onMessage(double timestamp, const void* message, int length) {
         if(length <= MIDI_MAX_MESSAGE_SIZE) {
             // Send through network.
-            Packet_MIDIMessage packet;
+            Packet_MIDIMessageJournal journal_packet;
+            Packet_MIDIMessageEcho& echo = journal_packet.data;
+            Packet_MIDIMessage& packet = echo.data;
             packet.type = PACKET_MIDIMessage;
             memcpy(packet.message.message, message, length);
             packet.message.length = length;
-            packet.message.timestamp = precise_time();
+            // Stamped by the driver, the input thread's wakeup delay is not included.
+            packet.message.timestamp = timestamp;
             packet.identifier.timestamp = packet.message.timestamp;
-            packet.identifier.serial = current_serial;
-            for(int i = 0; i < config.duplication; i++) {
-                // multiple send, avoid packet loss.
-                networking->send(packet);
-            }
-            current_serial += 1;
-            // Add to local playback queue.
-            packet.message.timestamp += config.latency;
+            echo.echo_timestamp = 0;
+            echo.echo_hold = 0;
+            int queued = 0;
             {
-                boost::lock_guard<boost::mutex> guard(mutex);
-                message_queue.push(packet.message);
+                // Every input device calls back on its own thread.
+                boost::lock_guard<boost::mutex> guard(send_mutex);
+                packet.identifier.serial = current_serial;
+                packet.identifier.session = current_session;
+                if(config.piggyback_sync) {
+                    boost::lock_guard<boost::mutex> echo_guard(echo_mutex);
+                    double hold = packet.message.timestamp - echo_received;
+                    if(echo_timestamp != 0 && hold < ECHO_MAX_HOLD) {
+                        packet.type = PACKET_MIDIMessageEcho;
+                        echo.echo_timestamp = echo_timestamp;
+                        echo.echo_hold = hold;
+                    }
+                }
+                if(config.journal > 0) {
+                    // Echo fields always present, zero when there is nothing to echo.
+                    packet.type = PACKET_MIDIMessageJournal;
+                    journal_packet.count = journal.write(timestamp, journal_packet.entries);
+                }
+                Packet_Parity parity;
+                // Close a stale group first, its parity shouldn't wait for this one.
+                if(config.fec > 0 && fec_encoder.flush(timestamp, parity)) queued += queueParity(timestamp, parity);
+                unsigned char wire[WIRE_BUNDLE_MAX_SIZE];
+                int size = 0;
+                bool ready = true;
+                if(config.bundle_window > 0) {
+                    ready = bundler.add(timestamp, journal_packet, wire, size);
+                    // The playback thread sends a held bundle when its window closes.
+                    double deadline = bundler.deadline();
+                    if(deadline < DEADLINE_NONE) timer->wakeAt(deadline);
+                } else {
+                    size = encodeMIDIPacket(journal_packet, wire);
+                }
+                if(ready) queued += queueDatagram(wire, size, config.duplication);
+                if(config.fec > 0) {
+                    if(fec_encoder.add(timestamp, packet, parity)) queued += queueParity(timestamp, parity);
+                    // The playback thread closes a group the next notes don't fill.
+                    double deadline = fec_encoder.deadline();
+                    if(deadline < DEADLINE_NONE) timer->wakeAt(deadline);
+                }
+                if(config.journal > 0) journal.add(current_serial, timestamp, (const unsigned char*)message, length);
+                current_serial += 1;
             }
+            sendQueued(queued);
+            // Add to local playback queue.
+            packet.message.timestamp += clock_snapshot.read().playout_delay;
+            enqueue(packet.message);
         } else {
             cout << "Warning: ignored oversized message: " << length << endl;
         }
     }
 
-    void PianoConnectApplication::onPacket(const void* packet_, int size) {
+    bool PianoConnectApplication::onMIDIPacket(double now, Packet_MIDIMessage* p, int size, bool recovered) {
+        double remote_sent = p->message.timestamp;
+        // Sender's timestamp in our clock, extrapolated with the drift.
+        p->message.timestamp = clock_model.toLocal(p->message.timestamp - offset_slew.residual(now));
+        if(!received_packets.accept(p->identifier.session, p->identifier.serial)) return false;
+        // A recovered packet arrived late and a bundled one was held by the
+        // sender, their timing says nothing about the clocks.
+        bool timed = !recovered && !receiving_bundle;
+        if(config.piggyback_sync && timed) {
+            boost::lock_guard<boost::mutex> guard(echo_mutex);
+            echo_timestamp = remote_sent;
+            echo_received = now;
+        }
+        Packet_MIDIMessageEcho* e = (Packet_MIDIMessageEcho*)p;
+        bool has_echo = p->type == PACKET_MIDIMessageEcho || (p->type == PACKET_MIDIMessageJournal && e->echo_timestamp != 0);
+        if(has_echo && timed && size >= (int)sizeof(Packet_MIDIMessageEcho)) {
+            // Our earlier message came back: a sync round for free.
+            feedClock(now, e->echo_timestamp, remote_sent - e->echo_hold, remote_sent, now);
+            onSyncRound(now);
+            num_echo_rounds.fetch_add(1, boost::memory_order_relaxed);
+        }
+        if(!recovered) {
+            double delay = now - p->message.timestamp;
+            if(clock_model.valid() && std::fabs(delay - latency_rs.average()) < JITTER_MAX_DEVIATION) jitter.feed(delay);
+            publishClock(now);
+        }
+        p->message.timestamp += config.auto_latency ? jitter.delay() : config.latency;
+        jitter.arrived(now, p->message.timestamp);
+        enqueue(p->message);
+        return true;
+    }
+
+    void PianoConnectApplication::onJournal(double now, double sent, const Packet_MIDIMessageJournal* packet, int size) {
+        const int header = (int)(sizeof(Packet_MIDIMessageJournal) - sizeof(JournalEntry) * JOURNAL_MAX_SIZE);
+        int count = std::min(std::min((int)packet->count, JOURNAL_MAX_SIZE), (size - header) / (int)sizeof(JournalEntry));
+        for(int i = 0; i < count; i++) {
+            const JournalEntry& entry = packet->entries[i];
+            if(!journalRecoverable(entry, JOURNAL_MAX_NOTE_AGE)) continue;
+            Packet_MIDIMessage repaired;
+            memset(&repaired, 0, sizeof(repaired));
+            repaired.type = PACKET_MIDIMessage;
+            repaired.message.length = entry.length;
+            memcpy(repaired.message.message, entry.message, entry.length);
+            repaired.message.timestamp = sent - entry.age;
+            repaired.identifier.serial = entry.serial;
+            repaired.identifier.session = packet->data.data.identifier.session;
+            repaired.identifier.timestamp = repaired.message.timestamp;
+            // With the sender's timestamp, which onMIDIPacket rewrites.
+            Packet_MIDIMessage original = repaired;
+            if(onMIDIPacket(now, &repaired, sizeof(repaired), true)) {
+                // A parity packet covering it mustn't rebuild it again.
+                fec_decoder.repaired(original);
+                num_repaired += 1;
+            }
+        }
+    }
+
+    int PianoConnectApplication::queueDatagram(const unsigned char* datagram, int size, int copies) {
+        OutgoingDatagram outgoing;
+        outgoing.size = size;
+        outgoing.copies = copies;
+        memcpy(outgoing.data, datagram, size);
+        // Full only when sends can't keep up: wait for the sending thread
+        // to make room, which doesn't need send_mutex.
+        while(!outbox.push(outgoing)) boost::this_thread::yield();
+        return 1;
+    }
+
+    int PianoConnectApplication::queueParity(double now, const Packet_Parity& parity) {
+        int queued = 0;
+        // A message the parity covers may still be held for bundling, the
+        // receiver must get it first or it would rebuild a packet in flight.
+        if(config.bundle_window > 0) {
+            unsigned char datagram[WIRE_BUNDLE_MAX_SIZE];
+            int size;
+            if(bundler.drain(now, datagram, size)) queued += queueDatagram(datagram, size, config.duplication);
+        }
+        unsigned char wire[WIRE_MAX_SIZE];
+        return queued + queueDatagram(wire, encodeParity(parity, wire), 1);
+    }
+
+    void PianoConnectApplication::sendQueued(int queued) {
+        if(queued == 0) return;
+        // Another thread is sending, it takes ours too, in queue order.
+        if(num_outgoing.fetch_add(queued) != 0) return;
+        OutgoingDatagram outgoing;
+        do {
+            outbox.pop(outgoing);
+            for(int i = 0; i < outgoing.copies; i++) {
+                // multiple send, avoid packet loss.
+                networking->send(outgoing.data, outgoing.size);
+            }
+        } while(num_outgoing.fetch_sub(1) != 1);
+    }
+
+    void PianoConnectApplication::onWirePacket(double now, const unsigned char* buffer, int size) {
+        if(isWireMIDI(buffer[0]) || buffer[0] == WIRE_V1_BUNDLE) {
+            Packet_MIDIMessageJournal packet;
+            Packet_MIDIMessage rest[WIRE_MAX_BUNDLE];
+            int decoded_size = 0, count = 0;
+            // Timestamps unwrap around the peer's clock as the model has it.
+            double remote_now = now + clock_model.offsetAt(now);
+            if(buffer[0] == WIRE_V1_BUNDLE) {
+                count = wire_decoder.decodeBundle(buffer, size, now, remote_now, packet, decoded_size, rest, WIRE_MAX_BUNDLE);
+            } else {
+                decoded_size = wire_decoder.decodeMIDIPacket(buffer, size, now, remote_now, packet);
+            }
+            if(decoded_size == 0 || count < 0) return;
+            receiving_bundle = buffer[0] == WIRE_V1_BUNDLE;
+            onPacketReceived(now, &packet, decoded_size);
+            // The rest of a bundle, in order.
+            for(int i = 0; i < count; i++) onPacketReceived(now, &rest[i], sizeof(Packet_MIDIMessage));
+            receiving_bundle = false;
+        } else if(buffer[0] == WIRE_V1_PARITY) {
+            Packet_Parity parity;
+            if(wire_decoder.decodeParity(buffer, size, parity)) onPacketReceived(now, &parity, sizeof(parity));
+        }
+    }
+
+    void PianoConnectApplication::onPacket(const void* packet, int size) {
+        onPacketReceived(precise_time(), packet, size);
+    }
+
+    void PianoConnectApplication::onPacketReceived(double now, const void* packet_, int size) {
         Packet* packet = (Packet*)packet_;
+        if(size < 1) return;
+        // Both clocks count from boot, the peer's may be days off ours. Until a
+        // sync round pins the offset its timestamps can't be placed, a note
+        // would be scheduled up to 35 minutes off: drop all but the sync.
+        if(!clock_model.valid() && packet->type != PACKET_ClockSync && packet->type != PACKET_ClockSyncAck) {
+            num_unsynced += 1;
+            return;
+        }
+        if(isWireMIDI(packet->type) || packet->type == WIRE_V1_PARITY || packet->type == WIRE_V1_BUNDLE) {
+            onWirePacket(now, (const unsigned char*)packet_, size);
+            return;
+        }
         num_packets += 1;
         switch(packet->type) {
-            case PACKET_MIDIMessage: {
+            case PACKET_MIDIMessage:
+            case PACKET_MIDIMessageEcho: {
                 Packet_MIDIMessage* p = (Packet_MIDIMessage*)packet;
-                p->message.timestamp -= delta;
-                p->message.timestamp += config.latency;
-                if(received_packets.find(p->identifier) == received_packets.end()) {
-                    received_packets.insert(p->identifier);
-                    {
-                        boost::lock_guard<boost::mutex> guard(mutex);
-                        message_queue.push(p->message);
-                    }
+                fec_decoder.received(*p);
+                onMIDIPacket(now, p, size, false);
+            } break;
+            case PACKET_MIDIMessageJournal: {
+
+                if(size < (int)(sizeof(Packet_MIDIMessageJournal) - sizeof(JournalEntry) * JOURNAL_MAX_SIZE)) break;
+                Packet_MIDIMessageJournal* p = (Packet_MIDIMessageJournal*)packet;
+                fec_decoder.received(p->data.data);
+                // Ages are relative to the sender's timestamp, which onMIDIPacket rewrites.
+                double sent = p->data.data.message.timestamp;
+                onMIDIPacket(now, &p->data.data, size, false);
+                onJournal(now, sent, p, size);
+
+            } break;
+            case PACKET_Parity: {
+
+                if(size < (int)sizeof(Packet_Parity)) break;
+                Packet_MIDIMessage recovered;
+                if(fec_decoder.recover(*(Packet_Parity*)packet, recovered)) {
+                    onMIDIPacket(now, &recovered, sizeof(recovered), true);
                 }
+
             } break;
             case PACKET_ClockSync: {
 
@@ -156,6 +479,7 @@ namespace PianoConnect {
                 Packet_ClockSync ack;
                 ack.type = PACKET_ClockSyncAck;
                 ack.timestamp_sent = p->timestamp_sent;
+                ack.timestamp_received = now;
                 ack.timestamp_ack = precise_time();
                 networking->send(ack);
 
@@ -164,34 +488,85 @@ namespace PianoConnect {
 
                 Packet_ClockSync* p = (Packet_ClockSync*)packet;
                 // NTP calculation. my_time + delta = other_time.
-                double timestamp_final = precise_time();
-                double delta_this = p->timestamp_ack - (p->timestamp_sent + timestamp_final) / 2.0;
-                double latency_this = (timestamp_final - p->timestamp_sent) / 2.0;
-                delta_rs.feed(delta_this);
+                double timestamp_final = now;
+                onSyncRound(timestamp_final);
+                // Older peers don't report when they received the sync.
+                double timestamp_received = p->timestamp_ack;
+                if(size >= (int)sizeof(Packet_ClockSync)) timestamp_received = p->timestamp_received;
+                double latency_this = (timestamp_final - p->timestamp_sent - (p->timestamp_ack - timestamp_received)) / 2.0;
+                feedClock(now, p->timestamp_sent, timestamp_received, p->timestamp_ack, timestamp_final);
                 latency_rs.feed(latency_this);
-                delta = delta_rs.average();
-                latency = latency_rs.average();
-                if(config.auto_latency) config.latency = latency * 1.1;
+                jitter.feed(latency_this);
+                jitter.update(timestamp_final);
+                publishClock(timestamp_final);
 
             } break;
         }
     }
 
-    void PianoConnectApplication::onTimer() {
-        double T = precise_time();
+    double PianoConnectApplication::onDeadline(double T) {
+        // Only a due bundle or parity group needs the send lock, and then
+        // never waits on it.
+        double retry = DEADLINE_NONE;
+        bool bundle_due = config.bundle_window > 0 && bundler.deadline() <= T;
+        bool group_due = config.fec > 0 && fec_encoder.deadline() <= T;
+        if(bundle_due || group_due) {
+            boost::unique_lock<boost::mutex> lock(send_mutex, boost::try_to_lock);
+            if(lock.owns_lock()) {
+                unsigned char wire[WIRE_BUNDLE_MAX_SIZE];
+                int size, queued = 0;
+                Packet_Parity parity;
+                if(group_due && fec_encoder.flush(T, parity)) queued += queueParity(T, parity);
+                if(bundle_due && bundler.flush(T, wire, size)) queued += queueDatagram(wire, size, config.duplication);
+                lock.unlock();
+                sendQueued(queued);
+            } else {
+                retry = T + SEND_RETRY;
+            }
+        }
+        // Phase 1: collect due messages into the batch, nothing shared is locked.
+        double t_collect = precise_time();
+        MIDIMessage incoming;
+        while(incoming_messages.pop(incoming)) {
+            if(has_scheduled_output) {
+                for(size_t i = 0; i < output_dispatchers.size(); i++) {
+                    if(output_dispatchers[i]->isScheduled()) output_dispatchers[i]->post(incoming);
+                }
+            }
+            message_queue.push(incoming);
+        }
+        dispatch_batch.clear();
+        while(message_queue.popDue(T, incoming)) {
+            dispatch_batch.push_back(incoming);
+        }
+        double next = message_queue.empty() ? DEADLINE_NONE : message_queue.top().timestamp;
+        if(config.bundle_window > 0) next = std::min(next, bundler.deadline());
+        if(config.fec > 0) next = std::min(next, fec_encoder.deadline());
+        next = std::min(next, retry);
+        if(dispatch_batch.empty()) return next;
+
+        // Phase 2: fan out to the per-device workers, no lock held.
+        double t_emit = precise_time();
+        for(size_t j = 0; j < dispatch_batch.size(); j++) {
+            for(size_t i = 0; i < output_dispatchers.size(); i++) {
+                if(!output_dispatchers[i]->isScheduled()) output_dispatchers[i]->post(dispatch_batch[j]);
+            }
+        }
+        num_midi_messages += dispatch_batch.size();
+        double t_done = precise_time();
+
+        // Phase 3: short critical section for the logs and counters.
         {
             boost::lock_guard<boost::mutex> guard(mutex);
-            while(!message_queue.empty() && message_queue.top().timestamp <= T) {
-                for(int i = 0; i < output_devices.size(); i++) {
-                    output_devices[i]->sendMessage(message_queue.top().message, message_queue.top().length);
-                }
-                if(log_stream) {
-                    log_messages.push_back(message_queue.top());
-                }
-                num_midi_messages += 1;
-                message_queue.pop();
+            double t_locked = precise_time();
+            if(log_stream) {
+                log_messages.insert(log_messages.end(), dispatch_batch.begin(), dispatch_batch.end());
             }
+            collect_phase.feed(t_emit - t_collect);
+            emit_phase.feed(t_done - t_emit);
+            lock_phase.feed(precise_time() - t_locked);
         }
+        return next;
     }
 
     int PianoConnectApplication::main() {
@@ -205,6 +580,42 @@ namespace PianoConnect {
         cout << "=======================================" << endl;
         cout << "Initialization:" << endl;
 
+        // Before anything takes a timestamp.
+        if(!setClockSource(config.clock_source)) {
+            cout << "  Warning: clock '" << clockSourceName(config.clock_source) << "' not available." << endl;
+        }
+        cout << "  Clock: " << clockSourceName(getClockSource()) << endl;
+
+        offset_slew.setWindow(config.slew_window);
+        if(config.fec > 0) fec_encoder.setGroupSize(config.fec);
+        if(config.journal > 0) journal.setSize(config.journal);
+        if(config.bundle_window > 0) bundler.setWindow(config.bundle_window);
+
+        // Start from the last session's drift and delay until the first sync rounds are in.
+        if(!config.sync_cache.empty()) {
+            SyncCalibration calibration;
+            if(loadSyncCache(config.sync_cache, peerName(), calibration)) {
+                clock_model.seed(calibration.skew);
+                jitter.seed(calibration.latency);
+                cout << "  Sync cache: " << peerName() << ", latency " << calibration.latency * 1000 << "ms" << endl;
+            }
+        }
+        // Before the network thread starts, it publishes from then on.
+        publishClock(precise_time());
+
+        // Threads pick up their policy as they start.
+        setRealtimePriority(config.realtime_priority);
+        for(size_t i = 0; i < config.cpu_affinity.size(); i++) {
+            setThreadAffinity(config.cpu_affinity[i].first, config.cpu_affinity[i].second);
+        }
+        if(config.realtime_priority > 0) {
+            cout << "  Real-time priority: " << config.realtime_priority << endl;
+        }
+
+        // Created first: input devices and the network may enqueue messages right away.
+        // The delegate is attached once output devices are set up.
+        timer.reset(DeadlineTimer::Create());
+
         if(config.connection_type == "udp") {
             networking.reset(NetworkConnection::CreateUDP(config.udp_remote, config.udp_local));
             cout << "  UDP: " << config.udp_local << " -> " << config.udp_remote << endl;
@@ -303,15 +714,27 @@ namespace PianoConnect {
             cout << "    Virtual Port: " << config.ports[i] << endl;
         }
 
-        cout << "Initialization Complete." << endl;
+        for(int i = 0; i < output_devices.size(); i++) {
+            bool scheduled = false;
+            if(config.scheduled_output) {
+                scheduled = output_devices[i]->enableScheduling();
+                cout << "    Output " << i << ": " << (scheduled ? "scheduled by driver" : "no driver scheduling, sending directly") << endl;
+            }
+            has_scheduled_output = has_scheduled_output || scheduled;
+            output_dispatchers.push_back(boost::shared_ptr<OutputDispatcher>(new OutputDispatcher(output_devices[i], scheduled)));
+        }
 
-        delta = 0;
-        latency = 0;
+        timer->setDelegate(this);
+        timer->wakeAt(precise_time());
+
+        // All threads are running by now, lock their stacks too.
+        if(config.lock_memory && lockMemory()) {
+            cout << "  Memory locked." << endl;
+        }
 
-        char status_line[100];
+        cout << "Initialization Complete." << endl;
 
-        boost::shared_ptr<HighResolutionTimer> timer(HighResolutionTimer::Create(1e-4));
-        timer->setDelegate(this);
+        char status_line[256];
 
         double time_reference = precise_time();
         if(config.log_file != "") {
@@ -324,25 +747,66 @@ namespace PianoConnect {
             logs << "TIME-REFERENCE " << fixed << setprecision(6) << time_reference << endl << endl << flush;
         }
 
+        // An answer to the startup burst must not trigger another one.
+        last_sync_ack = precise_time();
+        sendClockSyncBurst();
+
         int tick_index = 0;
+        int sync_interval = 1, ticks_since_sync = 0;
         for(;;) {
             sleep(0.2);
             tick_index += 1;
 
-            Packet_ClockSync packet;
-            packet.type = PACKET_ClockSync;
-            packet.timestamp_sent = precise_time();
-            networking->send(packet);
+            // Back off the pings while MIDI packets carry sync rounds.
+            if(num_echo_rounds.exchange(0) > 0) {
+                if(sync_interval < SYNC_MAX_INTERVAL) sync_interval *= 2;
+                if(sync_interval > SYNC_MAX_INTERVAL) sync_interval = SYNC_MAX_INTERVAL;
+            } else {
+                sync_interval = 1;
+            }
+            ticks_since_sync += 1;
+            if(sync_burst.exchange(false)) {
+                sendClockSyncBurst();
+                ticks_since_sync = 0;
+            } else if(ticks_since_sync >= sync_interval) {
+                sendClockSync();
+                ticks_since_sync = 0;
+            }
+
+            ClockSnapshot clock = clock_snapshot.read();
+
+            if(!config.sync_cache.empty() && tick_index % 50 == 0 && num_sync_acks > 0) {
+                SyncCalibration calibration;
+                calibration.skew = clock.skew;
+                calibration.latency = clock.playout_delay;
+                saveSyncCache(config.sync_cache, peerName(), calibration);
+            }
 
-            sprintf(status_line, "latency: %8.3lfms, network: %8.3lfms, dt: %10.3lfs, packets: %5d, midi: %5d", config.latency * 1000, latency * 1000, delta, num_packets, num_midi_messages);
+            sprintf(status_line, "latency: %8.3lfms, network: %8.3lfms, dt: %10.3lfs, packets: %5d, midi: %5d", clock.playout_delay * 1000, clock.network_latency * 1000, clock.offset, num_packets, num_midi_messages);
+            if(config.realtime_priority > 0) {
+                snprintf(status_line + strlen(status_line), 60, ", rt: %s", realtimeThreads().c_str());
+            }
+            int num_recovered = fec_decoder.numRecovered() + num_repaired;
+            if(config.fec > 0 || config.journal > 0 || num_recovered > 0) {
+                snprintf(status_line + strlen(status_line), 30, ", recovered: %d", num_recovered);
+            }
+            int dropped = num_dropped.load(boost::memory_order_relaxed);
+            if(dropped > 0) {
+                snprintf(status_line + strlen(status_line), 30, ", dropped: %d", dropped);
+            }
             cout << "\r" << status_line << flush;
 
             if(log_stream) {
                 std::deque<MIDIMessage> msgs;
+                PhaseStatistics collect, emit, lock;
                 {   // safe copy.
                     boost::lock_guard<boost::mutex> guard(mutex);
-                    msgs = log_messages;
-                    log_messages.clear();
+                    msgs.swap(log_messages);
+                    if(tick_index % 50 == 0) {
+                        collect = collect_phase; collect_phase.reset();
+                        emit = emit_phase; emit_phase.reset();
+                        lock = lock_phase; lock_phase.reset();
+                    }
                 }
                 // generate logs.
                 std::ostream& logs = *log_stream;
@@ -358,8 +822,45 @@ namespace PianoConnect {
                 }
                 if(tick_index % 50 == 0) {
                     std::stringstream line;
-                    line << "NTP latency " << fixed << setprecision(6) << config.latency << " network-latency " << latency << " delta " << delta;
+                    line << "NTP latency " << fixed << setprecision(6) << clock.playout_delay << " network-latency " << clock.network_latency << " delta " << clock.offset << " skew-ppm " << clock.skew * 1e6
+                         << " dispersion " << clock.dispersion << " residual " << clock.residual << " unsynced " << num_unsynced;
                     logs << line.str() << endl << flush;
+                    // Playout delay and late arrivals, in milliseconds.
+                    JitterStatistics js = jitter.statistics();
+                    std::stringstream jitter_line;
+                    jitter_line << "JITTER target " << fixed << setprecision(3) << js.target * 1e3 << " delay " << js.delay * 1e3
+                                << " arrivals " << js.arrivals << " late " << js.late.count
+                                << " " << js.late.average() * 1e3 << " " << js.late.maximum * 1e3;
+                    logs << jitter_line.str() << endl << flush;
+                    // Parity packets sent, packets rebuilt from the peer's parity.
+                    std::stringstream fec_line;
+                    fec_line << "FEC parity " << fec_encoder.numParity() << " recovered " << fec_decoder.numRecovered()
+                             << " unrecoverable " << fec_decoder.numUnrecoverable() << " journal " << num_repaired;
+                    logs << fec_line.str() << endl << flush;
+                    if(config.bundle_window > 0) {
+                        int messages, datagrams;
+                        bundler.statistics(messages, datagrams);
+                        std::stringstream bundle_line;
+                        bundle_line << "BUNDLE messages " << messages << " datagrams " << datagrams;
+                        logs << bundle_line.str() << endl << flush;
+                    }
+                    // Phase durations in microseconds, average / maximum.
+                    std::stringstream dispatch;
+                    dispatch << "DISPATCH rounds " << emit.count << fixed << setprecision(1)
+                             << " collect " << collect.average() * 1e6 << " " << collect.maximum * 1e6
+                             << " emit " << emit.average() * 1e6 << " " << emit.maximum * 1e6
+                             << " lock " << lock.average() * 1e6 << " " << lock.maximum * 1e6;
+                    logs << dispatch.str() << endl << flush;
+                    // Per output device: queue depth, lateness in microseconds.
+                    for(size_t i = 0; i < output_dispatchers.size(); i++) {
+                        OutputStatistics stats = output_dispatchers[i]->statistics();
+                        std::stringstream output;
+                        output << "OUTPUT " << i << " sent " << stats.lateness.count
+                               << " depth " << stats.depth << " " << stats.max_depth
+                               << " dropped " << stats.dropped << fixed << setprecision(1)
+                               << " late " << stats.lateness.average() * 1e6 << " " << stats.lateness.maximum * 1e6;
+                        logs << output.str() << endl << flush;
+                    }
                 }
             }
         }
@@ -0,0 +1,353 @@
+// Receive path test: feeds the application clock sync acks and MIDI
+// packets from a simulated peer, no network or MIDI devices involved.
+
+#include "pianoconnect.h"
+#include "wire.h"
+#include "timer.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <set>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+#include <boost/thread.hpp>
+
+using namespace PianoConnect;
+using namespace std;
+
+// The peer booted about three days before us. Modulo 2^24us, the period of
+// wire timestamps, its clock reads 4 s ahead of ours.
+const double PEER_OFFSET = 61 * 4294.967296 - 600.0;
+// One-way network delay of the simulated link.
+const double ONE_WAY = 0.01;
+
+const char* CONFIG_FILE = "pianoconnect_test.conf";
+
+int num_failed = 0;
+
+void check(bool condition, const char* what) {
+    cout << (condition ? "  ok: " : "  FAILED: ") << what << endl;
+    if(!condition) num_failed += 1;
+}
+
+// Keeps what the application sends.
+class CaptureConnection : public NetworkConnection {
+public:
+
+    CaptureConnection() : delay(0) { }
+
+    virtual void send(const void* packet, int size) {
+        // A socket stuck in the kernel.
+        if(delay > 0) sleep(delay);
+        const unsigned char* bytes = (const unsigned char*)packet;
+        sent.push_back(std::vector<unsigned char>(bytes, bytes + size));
+    }
+
+    virtual void setDelegate(Delegate*) { }
+
+    std::vector< std::vector<unsigned char> > sent;
+    double delay;
+};
+
+// An application as main() leaves it, minus devices and network.
+struct TestApplication {
+    TestApplication(const char* config_lines = "") {
+        {
+            std::ofstream config(CONFIG_FILE);
+            config << "# pianoconnect_test\n" << config_lines;
+        }
+        char name[] = "pianoconnect_test";
+        char* argv[] = { name, (char*)CONFIG_FILE };
+        app = new PianoConnectApplication(2, argv);
+        if(app->config.fec > 0) app->fec_encoder.setGroupSize(app->config.fec);
+        if(app->config.journal > 0) app->journal.setSize(app->config.journal);
+        if(app->config.bundle_window > 0) app->bundler.setWindow(app->config.bundle_window);
+        connection = new CaptureConnection();
+        app->networking.reset(connection);
+        app->timer.reset(DeadlineTimer::Create());
+        app->publishClock(precise_time());
+    }
+
+    ~TestApplication() {
+        delete app;
+        std::remove(CONFIG_FILE);
+    }
+
+    // A ping round answered at once by the peer, received at 'now'.
+    void syncRound(double now) {
+        Packet_ClockSync ack;
+        ack.type = PACKET_ClockSyncAck;
+        ack.timestamp_sent = now - 2 * ONE_WAY;
+        ack.timestamp_received = now - ONE_WAY + PEER_OFFSET;
+        ack.timestamp_ack = ack.timestamp_received;
+        app->onPacketReceived(now, &ack, sizeof(ack));
+    }
+
+    // A note the peer sent 'age' seconds before 'now', by its clock.
+    void note(double now, double age, unsigned int session = 7, unsigned int serial = 0) {
+        Packet_MIDIMessageJournal packet;
+        memset(&packet, 0, sizeof(packet));
+        Packet_MIDIMessage& data = packet.data.data;
+        data.type = PACKET_MIDIMessage;
+        data.message.length = 3;
+        data.message.message[0] = 0x90;
+        data.message.message[1] = 60;
+        data.message.message[2] = 64;
+        data.message.timestamp = now - age + PEER_OFFSET;
+        data.identifier.session = session;
+        data.identifier.serial = serial;
+        data.identifier.timestamp = data.message.timestamp;
+        unsigned char wire[WIRE_MAX_SIZE];
+        app->onPacketReceived(now, wire, encodeMIDIPacket(packet, wire));
+    }
+
+    int drain() {
+        int count = 0;
+        MIDIMessage message;
+        while(app->incoming_messages.pop(message)) count += 1;
+        return count;
+    }
+
+    PianoConnectApplication* app;
+    CaptureConnection* connection;
+};
+
+// A single wild one-way delay must not set the playout delay.
+void testJitterOutlier() {
+    cout << "Jitter outlier:" << endl;
+    TestApplication test;
+    double now = precise_time();
+    test.note(now, 0.3);
+    check(test.app->jitter.delay() < 0.1, "packet before any sync round leaves the delay alone");
+    test.syncRound(now);
+    for(int i = 1; i <= 20; i++) test.note(now, ONE_WAY, 7, i);
+    double before = test.app->jitter.delay();
+    check(before > ONE_WAY && before < 0.05, "delay follows the link");
+    // Sent two minutes ago as far as the timestamp goes.
+    test.note(now, 120.0, 7, 21);
+    check(test.app->jitter.delay() < 0.05, "outlier of two minutes is ignored");
+    test.drain();
+}
+
+// The first packet arrives before any sync ack: its timestamp can't be
+// placed and it must not be played, the ones after the ack are on time.
+void testBeforeSync() {
+    cout << "MIDI before the first sync round:" << endl;
+    TestApplication test;
+    double now = precise_time();
+    test.note(now, ONE_WAY, 7, 0);
+    check(test.drain() == 0, "packet before any ack is dropped");
+    test.syncRound(now);
+    test.note(now, ONE_WAY, 7, 1);
+    MIDIMessage message;
+    bool played = test.app->incoming_messages.pop(message);
+    check(played, "packet after the ack is played");
+    double playout = message.timestamp - now;
+    check(played && playout > -0.001 && playout < 0.05, "and scheduled within 50 ms");
+}
+
+// A parity group closing while its last messages are held for bundling:
+// the bundle has to go out before the parity.
+void testParityAfterBundle() {
+    cout << "Parity and bundling:" << endl;
+    TestApplication test("fec 4\nbundle 5\n");
+    double now = precise_time();
+    unsigned char message[3] = { 0x90, 60, 64 };
+    for(int i = 0; i < 4; i++) test.app->onMessage(now + i * 1e-4, message, 3);
+    const std::vector< std::vector<unsigned char> >& sent = test.connection->sent;
+    int bundle = -1, parity = -1;
+    for(size_t i = 0; i < sent.size(); i++) {
+        if(sent[i][0] == WIRE_V1_BUNDLE && bundle < 0) bundle = i;
+        if(sent[i][0] == WIRE_V1_PARITY && parity < 0) parity = i;
+    }
+    check(parity >= 0, "group of four closed");
+    check(bundle >= 0 && bundle < parity, "bundle sent before its parity");
+    test.drain();
+}
+
+// Two input devices, each calling back on its own thread: every message
+// gets a serial of its own. Rounds small enough for the playback queue.
+const int NUM_INPUT_MESSAGES = 500;
+const int NUM_INPUT_ROUNDS = 20;
+
+void playInput(PianoConnectApplication* app, double start, int channel) {
+    unsigned char message[3] = { (unsigned char)(0x90 | channel), 60, 64 };
+    for(int i = 0; i < NUM_INPUT_MESSAGES; i++) app->onMessage(start + i * 1e-4, message, 3);
+}
+
+void testTwoInputs() {
+    cout << "Two input devices:" << endl;
+    TestApplication test("journal 4\n");
+    double now = precise_time();
+    for(int round = 0; round < NUM_INPUT_ROUNDS; round++) {
+        double start = now + round * NUM_INPUT_MESSAGES * 1e-4;
+        boost::thread first(playInput, test.app, start, 0);
+        boost::thread second(playInput, test.app, start, 1);
+        first.join();
+        second.join();
+        test.drain();
+    }
+    const int total = 2 * NUM_INPUT_MESSAGES * NUM_INPUT_ROUNDS;
+    const std::vector< std::vector<unsigned char> >& sent = test.connection->sent;
+    WireDecoder decoder;
+    std::set<unsigned int> serials;
+    int errors = 0;
+    for(size_t i = 0; i < sent.size(); i++) {
+        Packet_MIDIMessageJournal packet;
+        if(decoder.decodeMIDIPacket(&sent[i][0], sent[i].size(), now, now, packet) == 0) {
+            errors += 1;
+            continue;
+        }
+        serials.insert(packet.data.data.identifier.serial);
+    }
+    check(errors == 0 && (int)sent.size() == total, "every message sent");
+    check((int)serials.size() == total, "no serial sent twice");
+    check((int)test.app->current_serial == total, "serial counts every message");
+}
+
+// The peer restarts, its new run sends serials from 0 again. Runs whose
+// sessions agree in the low bits are still told apart.
+int sendRun(TestApplication& receiver, TestApplication& sender, double now, int count) {
+    unsigned char message[3] = { 0x90, 60, 64 };
+    int played = 0;
+    for(int i = 0; i < count; i++) {
+        sender.connection->sent.clear();
+        sender.app->onMessage(now - ONE_WAY + PEER_OFFSET, message, 3);
+        for(size_t j = 0; j < sender.connection->sent.size(); j++) {
+            const std::vector<unsigned char>& datagram = sender.connection->sent[j];
+            receiver.app->onPacketReceived(now, &datagram[0], datagram.size());
+        }
+        played += receiver.drain();
+        sender.drain();
+    }
+    return played;
+}
+
+void testRestartedPeer() {
+    cout << "Restarted peer:" << endl;
+    TestApplication receiver;
+    double now = precise_time();
+    receiver.syncRound(now);
+    unsigned int first_session;
+    {
+        TestApplication first;
+        first_session = first.app->current_session;
+        check(sendRun(receiver, first, now, 3000) == 3000, "first run played");
+    }
+    TestApplication second;
+    second.app->current_session = first_session + 256;
+    check(sendRun(receiver, second, now, 100) == 100, "second run played from its first serial");
+}
+
+// An input thread is stuck sending: the next input thread and the
+// playback thread's bundle flush must not wait for it.
+void sendNote(PianoConnectApplication* app, double timestamp) {
+    unsigned char message[3] = { 0x90, 60, 64 };
+    app->onMessage(timestamp, message, 3);
+}
+
+void testSlowSocket() {
+    cout << "Slow socket:" << endl;
+    TestApplication test("bundle 5\n");
+    test.connection->delay = 0.05;
+    double now = precise_time();
+    boost::thread first(sendNote, test.app, now);
+    sleep(0.01);
+    double start = precise_time();
+    sendNote(test.app, now + 0.001);
+    double deadline = test.app->bundler.deadline();
+    test.app->onDeadline(deadline);
+    double blocked = precise_time() - start;
+    first.join();
+    cout << "  blocked for " << blocked * 1000 << " ms" << endl;
+    check(blocked < 0.01, "held note and its flush don't wait for the socket");
+    check(test.connection->sent.size() == 2, "both notes sent");
+    check(test.app->bundler.deadline() == DEADLINE_NONE, "nothing left held");
+    test.drain();
+}
+
+// The last note of a phrase leaves a partial parity group: it closes on
+// the playback thread's wakeup once 'window' old, not on the next note.
+void testPartialGroup() {
+    cout << "Partial parity group:" << endl;
+    TestApplication test("fec 4\n");
+    double now = precise_time();
+    unsigned char message[3] = { 0x90, 60, 64 };
+    test.app->onMessage(now, message, 3);
+    double deadline = test.app->fec_encoder.deadline();
+    check(deadline > now && deadline <= now + 0.0101, "group due 10 ms after its first note");
+    check(test.app->onDeadline(now + 0.001) <= deadline, "playback thread wakes for it");
+    test.app->onDeadline(deadline);
+    const std::vector< std::vector<unsigned char> >& sent = test.connection->sent;
+    check(sent.size() == 2 && sent[1][0] == WIRE_V1_PARITY, "parity sent at the deadline");
+    test.drain();
+}
+
+// A note held for bundling goes out up to a window after its timestamp:
+// it carries no echo, and the receiver doesn't echo it back.
+void testBundledEcho() {
+    cout << "Echo and bundling:" << endl;
+    TestApplication sender("bundle 5\npiggyback-sync\n"), receiver("piggyback-sync\n");
+    double now = precise_time();
+    receiver.syncRound(now);
+    double sent_at = now - ONE_WAY + PEER_OFFSET;
+    sender.app->echo_timestamp = now - 0.03;
+    sender.app->echo_received = sent_at - 0.005;
+    unsigned char message[3] = { 0x90, 60, 64 };
+    sender.app->onMessage(sent_at, message, 3);
+    sender.app->onMessage(sent_at + 0.001, message, 3);
+    sender.app->onDeadline(sender.app->bundler.deadline());
+    const std::vector< std::vector<unsigned char> >& sent = sender.connection->sent;
+    check(sent.size() == 2 && sent[1][0] == WIRE_V1_BUNDLE, "held note sent as a bundle");
+    WireDecoder decoder;
+    Packet_MIDIMessageJournal head;
+    int head_size = 0;
+    Packet_MIDIMessage rest[WIRE_MAX_BUNDLE];
+    decoder.decodeBundle(&sent[1][0], sent[1].size(), now, sent_at, head, head_size, rest, WIRE_MAX_BUNDLE);
+    check(head_size > 0 && head.data.data.type == PACKET_MIDIMessage, "without echo fields");
+    receiver.app->onPacketReceived(now, &sent[1][0], sent[1].size());
+    check(receiver.app->echo_timestamp == 0, "bundled note isn't echoed back");
+    receiver.app->onPacketReceived(now, &sent[0][0], sent[0].size());
+    check(receiver.app->echo_timestamp != 0, "note sent at once is");
+    check(receiver.app->num_echo_rounds.load() == 1, "and its echo is a sync round");
+    sender.drain();
+    receiver.drain();
+}
+
+// A note lost and played from the next packet's journal: the parity
+// covering it doesn't rebuild it a second time.
+void testJournalThenParity() {
+    cout << "Journal and parity:" << endl;
+    TestApplication sender("fec 2\njournal 4\n"), receiver;
+    double now = precise_time();
+    receiver.syncRound(now);
+    double sent_at = now - ONE_WAY + PEER_OFFSET;
+    unsigned char message[3] = { 0x90, 60, 64 };
+    sender.app->onMessage(sent_at, message, 3);
+    sender.app->onMessage(sent_at + 0.001, message, 3);
+    const std::vector< std::vector<unsigned char> >& sent = sender.connection->sent;
+    check(sent.size() == 3 && sent[2][0] == WIRE_V1_PARITY, "two notes and their parity");
+    // The first note is lost.
+    for(size_t i = 1; i < sent.size(); i++) receiver.app->onPacketReceived(now, &sent[i][0], sent[i].size());
+    check(receiver.drain() == 2, "both notes played");
+    check(receiver.app->num_repaired == 1, "one from the journal");
+    check(receiver.app->fec_decoder.numRecovered() == 0, "none counted again from parity");
+    sender.drain();
+}
+
+int main() {
+    testBeforeSync();
+    testJitterOutlier();
+    testParityAfterBundle();
+    testTwoInputs();
+    testRestartedPeer();
+    testSlowSocket();
+    testPartialGroup();
+    testBundledEcho();
+    testJournalThenParity();
+    cout << (num_failed == 0 ? "All passed." : "Failures.") << endl;
+    return num_failed == 0 ? 0 : 1;
+}
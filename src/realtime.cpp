@@ -0,0 +1,140 @@
+#include "realtime.h"
+
+#include <iostream>
+#include <map>
+#include <cstring>
+#include <cerrno>
+
+#include <boost/thread.hpp>
+
+#ifdef PLATFORM_WINDOWS
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+namespace PianoConnect {
+
+namespace {
+
+    const char* thread_names[] = { "playback", "output", "network", "midi-input" };
+    const int num_thread_names = 4;
+
+    struct ThreadResult {
+        int realtime, failed;
+        ThreadResult() : realtime(0), failed(0) { }
+    };
+
+    boost::mutex registry_mutex;
+    int realtime_priority = 0;
+    std::map<std::string, int> affinity;
+    std::map<std::string, ThreadResult> results;
+
+    // Returns an error message, empty on success.
+    std::string setPriority(int priority) {
+    #ifdef PLATFORM_WINDOWS
+        if(!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) return "SetThreadPriority failed";
+        return "";
+    #else
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        int lowest = sched_get_priority_min(SCHED_FIFO);
+        int highest = sched_get_priority_max(SCHED_FIFO);
+        param.sched_priority = priority < lowest ? lowest : (priority > highest ? highest : priority);
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if(err != 0) return strerror(err);
+        return "";
+    #endif
+    }
+
+    std::string setAffinity(int cpu) {
+    #if defined(PLATFORM_WINDOWS)
+        if(!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu)) return "SetThreadAffinityMask failed";
+        return "";
+    #elif defined(PLATFORM_LINUX)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if(err != 0) return strerror(err);
+        return "";
+    #else
+        return "not supported on this platform";
+    #endif
+    }
+
+}
+
+    bool isThreadName(const std::string& name) {
+        for(int i = 0; i < num_thread_names; i++) {
+            if(name == thread_names[i]) return true;
+        }
+        return false;
+    }
+
+    void setRealtimePriority(int priority) {
+        boost::lock_guard<boost::mutex> guard(registry_mutex);
+        realtime_priority = priority;
+    }
+
+    void setThreadAffinity(const std::string& name, int cpu) {
+        boost::lock_guard<boost::mutex> guard(registry_mutex);
+        affinity[name] = cpu;
+    }
+
+    void applyThreadPolicy(const std::string& name) {
+        boost::lock_guard<boost::mutex> guard(registry_mutex);
+        ThreadResult& result = results[name];
+        std::map<std::string, int>::iterator it = affinity.find(name);
+        if(it != affinity.end() && it->second >= 0) {
+            std::string error = setAffinity(it->second);
+            if(!error.empty()) {
+                cout << "Warning: cannot pin " << name << " thread to CPU " << it->second << ": " << error << endl;
+            }
+        }
+        if(realtime_priority > 0) {
+            std::string error = setPriority(realtime_priority);
+            if(error.empty()) {
+                result.realtime += 1;
+            } else {
+                // Warn once per name, the thread keeps the normal scheduler.
+                if(result.failed == 0) {
+                    cout << "Warning: no real-time priority for " << name << " thread: " << error << endl;
+                }
+                result.failed += 1;
+            }
+        }
+    }
+
+    bool lockMemory() {
+    #ifdef PLATFORM_WINDOWS
+        cout << "Warning: memory locking is not supported on this platform." << endl;
+        return false;
+    #else
+        if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+            cout << "Warning: cannot lock memory: " << strerror(errno) << endl;
+            return false;
+        }
+        return true;
+    #endif
+    }
+
+    std::string realtimeThreads() {
+        boost::lock_guard<boost::mutex> guard(registry_mutex);
+        std::string list;
+        for(int i = 0; i < num_thread_names; i++) {
+            std::map<std::string, ThreadResult>::iterator it = results.find(thread_names[i]);
+            if(it == results.end() || it->second.realtime == 0) continue;
+            if(!list.empty()) list += ",";
+            list += thread_names[i];
+            // Some threads of this name missed out.
+            if(it->second.failed > 0) list += "*";
+        }
+        return list.empty() ? "none" : list;
+    }
+
+}
@@ -0,0 +1,96 @@
+// RunningStatistics against brute force over the same window: 2M samples
+// around 1e9, where a running sum would lose its precision. Then the cost
+// per sample.
+
+#include "statistics.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <ctime>
+
+using namespace PianoConnect;
+using namespace std;
+
+const int NUM_SAMPLES = 2000000;
+// Percentiles are checked on every this many samples, they need a sort.
+const int PERCENTILE_EVERY = 997;
+
+int num_failed = 0;
+
+void check(bool condition, const char* what) {
+    cout << (condition ? "  ok: " : "  FAILED: ") << what << endl;
+    if(!condition) num_failed += 1;
+}
+
+template < int Capacity >
+void compare() {
+    cout << "Window of " << Capacity << ":" << endl;
+    srand(Capacity);
+    RunningStatistics<Capacity> statistics;
+    vector<double> window;
+    double mean_error = 0, deviation_error = 0, order_error = 0;
+    for(int i = 0; i < NUM_SAMPLES; i++) {
+        double value = 1e9 + (double)rand() / RAND_MAX;
+        statistics.feed(value);
+        window.push_back(value);
+        if((int)window.size() > Capacity) window.erase(window.begin());
+
+        double sum = 0;
+        for(size_t j = 0; j < window.size(); j++) sum += window[j] - 1e9;
+        double mean = 1e9 + sum / window.size();
+        double m2 = 0;
+        for(size_t j = 0; j < window.size(); j++) m2 += (window[j] - mean) * (window[j] - mean);
+        double deviation = window.size() > 1 ? sqrt(m2 / (window.size() - 1)) : 0;
+        mean_error = max(mean_error, fabs(statistics.average() - mean));
+        deviation_error = max(deviation_error, fabs(statistics.deviation() - deviation));
+        order_error = max(order_error, fabs(statistics.minimum() - *min_element(window.begin(), window.end())));
+        order_error = max(order_error, fabs(statistics.maximum() - *max_element(window.begin(), window.end())));
+
+        if(i % PERCENTILE_EVERY == 0) {
+            vector<double> sorted(window);
+            sort(sorted.begin(), sorted.end());
+            double ps[] = { 0.0, 0.5, 0.9, 0.99, 1.0 };
+            for(int k = 0; k < 5; k++) {
+                double position = ps[k] * (sorted.size() - 1);
+                size_t index = (size_t)position;
+                double expected = index + 1 < sorted.size() ? sorted[index] + (sorted[index + 1] - sorted[index]) * (position - index) : sorted.back();
+                order_error = max(order_error, fabs(statistics.percentile(ps[k]) - expected));
+            }
+        }
+    }
+    cout << "  largest difference: mean " << mean_error << ", deviation " << deviation_error
+         << ", minimum/maximum/percentiles " << order_error << endl;
+    check(mean_error < 1e-5, "mean at double precision");
+    check(deviation_error < 1e-5, "deviation at double precision");
+    check(order_error == 0, "minimum, maximum and percentiles exact");
+}
+
+// Cost per sample of the sorted window, which moves up to Capacity doubles.
+template < int Capacity >
+void timeFeed() {
+    srand(Capacity);
+    static double values[NUM_SAMPLES];
+    for(int i = 0; i < NUM_SAMPLES; i++) values[i] = 1e9 + (double)rand() / RAND_MAX;
+    RunningStatistics<Capacity> statistics;
+    double sum = 0;
+    clock_t t0 = clock();
+    for(int i = 0; i < NUM_SAMPLES; i++) {
+        statistics.feed(values[i]);
+        sum += statistics.percentile(0.99);
+    }
+    double seconds = (double)(clock() - t0) / CLOCKS_PER_SEC;
+    cout << "Window of " << Capacity << ": " << seconds / NUM_SAMPLES * 1e9 << " ns per feed and percentile ("
+         << sum / NUM_SAMPLES - 1e9 << ")" << endl;
+}
+
+int main() {
+    compare<40>();
+    compare<256>();
+    timeFeed<40>();
+    timeFeed<256>();
+    cout << (num_failed == 0 ? "All passed." : "Failures.") << endl;
+    return num_failed == 0 ? 0 : 1;
+}
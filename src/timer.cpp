@@ -1,93 +1,333 @@
 #include "timer.h"
+#include "realtime.h"
 
 #include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <stdint.h>
 
 #include <boost/thread.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#elif defined(PLATFORM_MACOSX)
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIANOCONNECT_HAS_TSC
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
 using namespace std;
 
 namespace PianoConnect {
 
-    boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+namespace {
+
+    typedef boost::int64_t (*ClockReader)();
+
+    // The platform's monotonic clock; on Windows and Mac OS X it is never
+    // slewed, so it serves both monotonic sources.
+#if defined(PLATFORM_WINDOWS)
+    boost::int64_t read_monotonic() {
+        static LARGE_INTEGER frequency;
+        if(frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        // Split to avoid overflowing 64 bits.
+        boost::int64_t f = frequency.QuadPart, c = counter.QuadPart;
+        return c / f * 1000000000LL + c % f * 1000000000LL / f;
+    }
+    boost::int64_t read_monotonic_raw() {
+        return read_monotonic();
+    }
+#elif defined(PLATFORM_MACOSX)
+    boost::int64_t read_monotonic() {
+        static mach_timebase_info_data_t timebase;
+        if(timebase.denom == 0) mach_timebase_info(&timebase);
+        return (boost::int64_t)(mach_absolute_time() * timebase.numer / timebase.denom);
+    }
+    boost::int64_t read_monotonic_raw() {
+        return read_monotonic();
+    }
+#else
+    boost::int64_t read_monotonic() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (boost::int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+    boost::int64_t read_monotonic_raw() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        return (boost::int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+#endif
+
+#ifdef PIANOCONNECT_HAS_TSC
+    // ns = tsc_base_ns + (tsc - tsc_base) * tsc_ns_per_tick
+    boost::uint64_t tsc_base;
+    boost::int64_t tsc_base_ns;
+    double tsc_ns_per_tick;
+
+    boost::int64_t read_tsc() {
+        boost::int64_t ticks = (boost::int64_t)(__rdtsc() - tsc_base);
+        return tsc_base_ns + (boost::int64_t)((double)ticks * tsc_ns_per_tick);
+    }
+
+    // Only an invariant TSC ticks at a constant rate across power states.
+    bool calibrateTSC() {
+        unsigned int eax, ebx, ecx, edx;
+        if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) return false;
+        // Pair both clocks over 50ms, reading the TSC on both sides of the reference.
+        boost::uint64_t t0 = __rdtsc();
+        boost::int64_t n0 = read_monotonic_raw();
+        boost::uint64_t t1 = __rdtsc();
+        boost::int64_t n1;
+        boost::uint64_t t2, t3;
+        do {
+            t2 = __rdtsc();
+            n1 = read_monotonic_raw();
+            t3 = __rdtsc();
+        } while(n1 - n0 < 50000000LL);
+        double ticks = (double)((t2 + t3) / 2 - (t0 + t1) / 2);
+        if(ticks <= 0) return false;
+        tsc_ns_per_tick = (double)(n1 - n0) / ticks;
+        tsc_base = (t2 + t3) / 2;
+        tsc_base_ns = n1;
+        return true;
+    }
+#endif
+
+    ClockReader clock_reader = read_monotonic;
+    ClockSource clock_source = CLOCK_SOURCE_MONOTONIC;
+
+}
+
+    bool setClockSource(ClockSource source) {
+        switch(source) {
+            case CLOCK_SOURCE_MONOTONIC: {
+                clock_reader = read_monotonic;
+            } break;
+            case CLOCK_SOURCE_MONOTONIC_RAW: {
+                clock_reader = read_monotonic_raw;
+            } break;
+            case CLOCK_SOURCE_TSC: {
+            #ifdef PIANOCONNECT_HAS_TSC
+                if(!calibrateTSC()) return false;
+                clock_reader = read_tsc;
+            #else
+                return false;
+            #endif
+            } break;
+            default: return false;
+        }
+        clock_source = source;
+        return true;
+    }
+
+    ClockSource getClockSource() {
+        return clock_source;
+    }
+
+    const char* clockSourceName(ClockSource source) {
+        switch(source) {
+            case CLOCK_SOURCE_MONOTONIC: return "monotonic";
+            case CLOCK_SOURCE_MONOTONIC_RAW: return "monotonic-raw";
+            case CLOCK_SOURCE_TSC: return "tsc";
+        }
+        return "unknown";
+    }
+
+    bool parseClockSource(const std::string& name, ClockSource& source) {
+        ClockSource sources[] = { CLOCK_SOURCE_MONOTONIC, CLOCK_SOURCE_MONOTONIC_RAW, CLOCK_SOURCE_TSC };
+        for(int i = 0; i < 3; i++) {
+            if(name == clockSourceName(sources[i])) {
+                source = sources[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    boost::int64_t precise_time_ns() {
+        return clock_reader();
+    }
 
     double precise_time() {
-        double t = (boost::posix_time::microsec_clock::local_time() - epoch).total_microseconds() / 1000000.0;
-        return t;
+        return (double)clock_reader() * 1e-9;
     }
 
     void sleep(double seconds) {
-        boost::this_thread::sleep(boost::posix_time::microseconds(seconds * 1e6));
+        boost::this_thread::sleep(boost::posix_time::microseconds((long)(seconds * 1e6)));
     }
 
 }
 
-#ifdef PLATFORM_WINDOWS
+#if defined(PLATFORM_LINUX)
 
-#include <windows.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
 namespace PianoConnect {
 
-    void CALLBACK win_timer_callback(UINT uID, UINT uMsg, DWORD_PTR dwUser, DWORD_PTR dw1, DWORD_PTR dw2);
-
-    class HighResolutionTimer_Impl : public HighResolutionTimer {
+    // Sleeps on a timerfd armed with an absolute CLOCK_MONOTONIC expiry;
+    // an eventfd in the same poll set lets wakeAt() pull the deadline in.
+    class DeadlineTimer_Impl : public DeadlineTimer {
     public:
 
-        HighResolutionTimer_Impl(double interval) {
-            TIMECAPS caps;
-            timeGetDevCaps(&caps, sizeof(TIMECAPS));
-            timeBeginPeriod(caps.wPeriodMin);
-            int interval_ms = interval * 1000;
-            if(interval_ms < caps.wPeriodMin) interval_ms = caps.wPeriodMin;
-            if(interval_ms > caps.wPeriodMax) interval_ms = caps.wPeriodMax;
-            timer = timeSetEvent(interval_ms, caps.wPeriodMin, win_timer_callback, (DWORD_PTR)this, TIME_PERIODIC);
-            if(timer == NULL) {
-                throw std::invalid_argument("Error creating high resolution timer of interval: " + boost::to_string(interval));
+        struct ThreadInfo {
+            DeadlineTimer_Impl* self;
+            void operator() () {
+                self->run();
+            }
+        };
+
+        DeadlineTimer_Impl() {
+            delegate = NULL;
+            should_stop = false;
+            deadline = DEADLINE_NONE;
+            timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+            wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if(timer_fd < 0 || wake_fd < 0) {
+                throw std::runtime_error("Error creating deadline timer.");
             }
+            ThreadInfo thread_info;
+            thread_info.self = this;
+            thread = boost::thread(thread_info);
         }
 
         virtual void setDelegate(Delegate* delegate_) {
             delegate = delegate_;
         }
 
-        virtual ~HighResolutionTimer_Impl() {
-            timeKillEvent(timer);
+        virtual void wakeAt(double deadline_) {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex);
+                if(deadline_ >= deadline) return;
+                deadline = deadline_;
+            }
+            wake();
+        }
+
+        virtual ~DeadlineTimer_Impl() {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex);
+                should_stop = true;
+            }
+            wake();
+            thread.join();
+            close(timer_fd);
+            close(wake_fd);
+        }
+
+        void wake() {
+            uint64_t one = 1;
+            ssize_t r = write(wake_fd, &one, sizeof(one));
+            (void)r;
+        }
+
+        // Arm the timerfd for an absolute precise_time() deadline.
+        void arm(double target, double now) {
+            itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+            if(target < DEADLINE_NONE) {
+                timespec mono;
+                clock_gettime(CLOCK_MONOTONIC, &mono);
+                double wait = target - now;
+                long long ns = (long long)mono.tv_sec * 1000000000LL + mono.tv_nsec + (long long)(wait * 1e9);
+                spec.it_value.tv_sec = ns / 1000000000LL;
+                spec.it_value.tv_nsec = ns % 1000000000LL;
+                timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+            } else {
+                // Disarm, wait for wakeAt().
+                timerfd_settime(timer_fd, 0, &spec, NULL);
+            }
+        }
+
+        void run() {
+            applyThreadPolicy("playback");
+            // Default timer slack is 50us, ask for the tightest wakeup.
+            prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+            pollfd fds[2];
+            fds[0].fd = timer_fd;
+            fds[0].events = POLLIN;
+            fds[1].fd = wake_fd;
+            fds[1].events = POLLIN;
+
+            for(;;) {
+                double target;
+                {
+                    boost::lock_guard<boost::mutex> guard(mutex);
+                    if(should_stop) break;
+                    target = deadline;
+                }
+                double now = precise_time();
+                if(target <= now) {
+                    // Reset before the callback so wakeAt() calls made meanwhile are kept.
+                    {
+                        boost::lock_guard<boost::mutex> guard(mutex);
+                        deadline = DEADLINE_NONE;
+                    }
+                    double next = delegate ? delegate->onDeadline(now) : DEADLINE_NONE;
+                    {
+                        boost::lock_guard<boost::mutex> guard(mutex);
+                        if(next < deadline) deadline = next;
+                    }
+                    continue;
+                }
+                arm(target, now);
+                if(poll(fds, 2, -1) > 0) {
+                    uint64_t value;
+                    ssize_t r;
+                    if(fds[0].revents & POLLIN) r = read(timer_fd, &value, sizeof(value));
+                    if(fds[1].revents & POLLIN) r = read(wake_fd, &value, sizeof(value));
+                    (void)r;
+                }
+            }
         }
 
         Delegate* delegate;
-        MMRESULT timer;
+        bool should_stop;
+        double deadline;
+        int timer_fd, wake_fd;
+        boost::mutex mutex;
+        boost::thread thread;
     };
 
-    void CALLBACK win_timer_callback(UINT uID, UINT uMsg, DWORD_PTR dwUser, DWORD_PTR dw1, DWORD_PTR dw2) {
-        HighResolutionTimer_Impl* impl = (HighResolutionTimer_Impl*)dwUser;
-        if(impl->delegate) impl->delegate->onTimer();
-    }
-
 }
 
-#endif
-
-#if defined(PLATFORM_MACOSX) || defined(PLATFORM_LINUX)
+#else
 
 namespace PianoConnect {
 
-    class HighResolutionTimer_Impl : public HighResolutionTimer {
+    // Portable fallback: condition variable with a timed wait.
+    class DeadlineTimer_Impl : public DeadlineTimer {
     public:
 
         struct ThreadInfo {
-            HighResolutionTimer_Impl* self;
+            DeadlineTimer_Impl* self;
             void operator() () {
-                while(!self->should_stop) {
-                    sleep(self->duration);
-                    if(self->delegate)
-                        self->delegate->onTimer();
-                }
+                self->run();
             }
         };
 
-        HighResolutionTimer_Impl(double interval) {
-            duration = interval;
+        DeadlineTimer_Impl() {
+            #ifdef PLATFORM_WINDOWS
+            timeBeginPeriod(1);
+            #endif
+            delegate = NULL;
             should_stop = false;
+            deadline = DEADLINE_NONE;
             ThreadInfo thread_info;
             thread_info.self = this;
             thread = boost::thread(thread_info);
@@ -97,14 +337,49 @@ namespace PianoConnect {
             delegate = delegate_;
         }
 
-        virtual ~HighResolutionTimer_Impl() {
-            should_stop = true;
+        virtual void wakeAt(double deadline_) {
+            boost::lock_guard<boost::mutex> guard(mutex);
+            if(deadline_ >= deadline) return;
+            deadline = deadline_;
+            condition.notify_one();
+        }
+
+        virtual ~DeadlineTimer_Impl() {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex);
+                should_stop = true;
+                condition.notify_one();
+            }
             thread.join();
+            #ifdef PLATFORM_WINDOWS
+            timeEndPeriod(1);
+            #endif
+        }
+
+        void run() {
+            applyThreadPolicy("playback");
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while(!should_stop) {
+                double now = precise_time();
+                if(deadline <= now) {
+                    deadline = DEADLINE_NONE;
+                    lock.unlock();
+                    double next = delegate ? delegate->onDeadline(now) : DEADLINE_NONE;
+                    lock.lock();
+                    if(next < deadline) deadline = next;
+                } else if(deadline < DEADLINE_NONE) {
+                    condition.timed_wait(lock, boost::posix_time::microseconds((long)((deadline - now) * 1e6)));
+                } else {
+                    condition.wait(lock);
+                }
+            }
         }
 
         Delegate* delegate;
         bool should_stop;
-        double duration;
+        double deadline;
+        boost::mutex mutex;
+        boost::condition_variable condition;
         boost::thread thread;
     };
 
@@ -114,8 +389,8 @@ namespace PianoConnect {
 
 namespace PianoConnect {
 
-    HighResolutionTimer* HighResolutionTimer::Create(double interval) {
-        return new HighResolutionTimer_Impl(interval);
+    DeadlineTimer* DeadlineTimer::Create() {
+        return new DeadlineTimer_Impl();
     }
 
 }
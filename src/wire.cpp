@@ -0,0 +1,472 @@
+#include "wire.h"
+
+#include <cmath>
+#include <cstring>
+
+#include <boost/cstdint.hpp>
+
+namespace PianoConnect {
+
+namespace {
+
+    boost::int64_t toMicroseconds(double t) {
+        return (boost::int64_t)std::floor(t * 1e6 + 0.5);
+    }
+
+    // The value congruent to 'low' modulo 2^32 closest to 'reference'.
+    boost::int64_t unwrap32(boost::uint32_t low, boost::int64_t reference) {
+        boost::int32_t difference = (boost::int32_t)(low - (boost::uint32_t)reference);
+        return reference + difference;
+    }
+
+    // The same modulo 2^24.
+    boost::int64_t unwrap24(boost::uint32_t low, boost::int64_t reference) {
+        boost::int32_t difference = (boost::int32_t)((low - (boost::uint32_t)reference) << 8) >> 8;
+        return reference + difference;
+    }
+
+    // Small negative values stay small.
+    boost::uint64_t zigzag(boost::int64_t value) {
+        return value < 0 ? ((boost::uint64_t)(-(value + 1)) << 1) | 1 : (boost::uint64_t)value << 1;
+    }
+
+    boost::int64_t unzigzag(boost::uint64_t value) {
+        return (value & 1) ? -(boost::int64_t)(value >> 1) - 1 : (boost::int64_t)(value >> 1);
+    }
+
+    class Writer {
+    public:
+
+        Writer(unsigned char* buffer_) : buffer(buffer_), size(0) { }
+
+        void byte(unsigned int value) {
+            buffer[size++] = (unsigned char)value;
+        }
+
+        void u16(unsigned int value) {
+            byte(value & 0xFF);
+            byte((value >> 8) & 0xFF);
+        }
+
+        void u24(boost::uint32_t value) {
+            u16(value & 0xFFFF);
+            byte((value >> 16) & 0xFF);
+        }
+
+        void u32(boost::uint32_t value) {
+            u16(value & 0xFFFF);
+            u16(value >> 16);
+        }
+
+        void u64(boost::uint64_t value) {
+            u32((boost::uint32_t)value);
+            u32((boost::uint32_t)(value >> 32));
+        }
+
+        void varint(boost::uint64_t value) {
+            while(value >= 0x80) {
+                byte((unsigned int)(value & 0x7F) | 0x80);
+                value >>= 7;
+            }
+            byte((unsigned int)value);
+        }
+
+        void svarint(boost::int64_t value) {
+            varint(zigzag(value));
+        }
+
+        void bytes(const unsigned char* data, int length) {
+            memcpy(buffer + size, data, length);
+            size += length;
+        }
+
+        unsigned char* buffer;
+        int size;
+    };
+
+    // Reading past the end clears 'ok' and yields zeros.
+    class Reader {
+    public:
+
+        Reader(const unsigned char* buffer_, int size_) : buffer(buffer_), size(size_), position(0), ok(true) { }
+
+        unsigned int peek() {
+            return position < size ? buffer[position] : 0;
+        }
+
+        unsigned int byte() {
+            if(position >= size) {
+                ok = false;
+                return 0;
+            }
+            return buffer[position++];
+        }
+
+        unsigned int u16() {
+            unsigned int low = byte();
+            return low | (byte() << 8);
+        }
+
+        boost::uint32_t u24() {
+            boost::uint32_t low = u16();
+            return low | ((boost::uint32_t)byte() << 16);
+        }
+
+        boost::uint32_t u32() {
+            boost::uint32_t low = u16();
+            return low | ((boost::uint32_t)u16() << 16);
+        }
+
+        boost::uint64_t u64() {
+            boost::uint64_t low = u32();
+            return low | ((boost::uint64_t)u32() << 32);
+        }
+
+        boost::uint64_t varint() {
+            boost::uint64_t value = 0;
+            for(int shift = 0; shift < 64; shift += 7) {
+                unsigned int b = byte();
+                value |= (boost::uint64_t)(b & 0x7F) << shift;
+                if(!(b & 0x80)) return value;
+            }
+            ok = false;
+            return 0;
+        }
+
+        boost::int64_t svarint() {
+            return unzigzag(varint());
+        }
+
+        void bytes(unsigned char* data, int length) {
+            if(position + length > size) {
+                ok = false;
+                memset(data, 0, length);
+                return;
+            }
+            memcpy(data, buffer + position, length);
+            position += length;
+        }
+
+        const unsigned char* buffer;
+        int size, position;
+        bool ok;
+    };
+
+    int clampLength(int length) {
+        return length < 0 ? 0 : (length > MIDI_MAX_MESSAGE_SIZE ? MIDI_MAX_MESSAGE_SIZE : length);
+    }
+
+}
+
+    int impliedLength(unsigned char status) {
+        if(status < 0x80) return 0;
+        if(status < 0xC0) return 3;
+        if(status < 0xE0) return 2;
+        if(status < 0xF0) return 3;
+        switch(status) {
+            case 0xF1: case 0xF3: return 2;
+            case 0xF2: return 3;
+            case 0xF6: case 0xF8: case 0xF9: case 0xFA: case 0xFB:
+            case 0xFC: case 0xFD: case 0xFE: case 0xFF: return 1;
+        }
+        // SysEx and undefined status bytes.
+        return 0;
+    }
+
+    int encodeMIDIPacket(const Packet_MIDIMessageJournal& packet, unsigned char* buffer) {
+        const Packet_MIDIMessage& data = packet.data.data;
+        bool journal = data.type == PACKET_MIDIMessageJournal;
+        bool echo = data.type == PACKET_MIDIMessageEcho || (journal && packet.data.echo_timestamp != 0);
+        int length = clampLength(data.message.length);
+        bool explicit_length = length == 0 || impliedLength(data.message.message[0]) != length;
+
+        unsigned char flags = 0;
+        if(echo) flags |= WIRE_FLAG_ECHO;
+        if(journal) flags |= WIRE_FLAG_JOURNAL;
+        if(explicit_length) flags |= WIRE_FLAG_LENGTH;
+
+        Writer out(buffer);
+        out.byte(WIRE_V1_MIDI | flags);
+        out.u16(data.identifier.session & 0xFFFF);
+        out.u16(data.identifier.serial & 0xFFFF);
+        out.u24((boost::uint32_t)toMicroseconds(data.message.timestamp) & 0xFFFFFF);
+        if(explicit_length) out.byte(length);
+        out.bytes(data.message.message, length);
+        if(echo) {
+            out.u32((boost::uint32_t)toMicroseconds(packet.data.echo_timestamp));
+            out.svarint(toMicroseconds(packet.data.echo_hold));
+        }
+        if(journal) {
+            // Entries whose length the status byte doesn't give are left out.
+            int count_position = out.size;
+            int count = 0;
+            out.byte(0);
+            for(unsigned int i = 0; i < packet.count && i < (unsigned int)JOURNAL_MAX_SIZE; i++) {
+                const JournalEntry& entry = packet.entries[i];
+                if(entry.length < 1 || impliedLength(entry.message[0]) != entry.length) continue;
+                out.varint(data.identifier.serial - entry.serial);
+                out.varint(entry.age > 0 ? toMicroseconds(entry.age) : 0);
+                out.bytes(entry.message, entry.length);
+                count += 1;
+            }
+            buffer[count_position] = (unsigned char)count;
+        }
+        return out.size;
+    }
+
+    int encodeParity(const Packet_Parity& parity, unsigned char* buffer) {
+        Writer out(buffer);
+        out.byte(WIRE_V1_PARITY);
+        out.byte(parity.count);
+        out.u16(parity.session & 0xFFFF);
+        out.u16(parity.first_serial & 0xFFFF);
+        out.bytes(parity.parity, MIDI_RECORD_SIZE);
+        return out.size;
+    }
+
+    void encodeRecord(const MIDIMessage& message, unsigned char* record) {
+        memset(record, 0, MIDI_RECORD_SIZE);
+        int length = clampLength(message.length);
+        record[0] = (unsigned char)length;
+        memcpy(record + 1, message.message, length);
+        Writer out(record + 1 + MIDI_MAX_MESSAGE_SIZE);
+        out.u64((boost::uint64_t)toMicroseconds(message.timestamp));
+    }
+
+    void decodeRecord(const unsigned char* record, MIDIMessage& message) {
+        memset(&message, 0, sizeof(message));
+        message.length = clampLength(record[0]);
+        memcpy(message.message, record + 1, message.length);
+        Reader in(record + 1 + MIDI_MAX_MESSAGE_SIZE, 8);
+        message.timestamp = (boost::int64_t)in.u64() / 1e6;
+    }
+
+    WireDecoder::WireDecoder() {
+        has_serial = false;
+        last_session = 0;
+        last_serial = 0;
+    }
+
+    unsigned int WireDecoder::extendSerial(unsigned int session, unsigned int low) {
+        // Serials start at 0 in a new session, so the low bits are the serial.
+        if(!has_serial || session != last_session) {
+            has_serial = true;
+            last_session = session;
+            last_serial = low;
+            return low;
+        }
+        boost::int16_t difference = (boost::int16_t)(boost::uint16_t)(low - last_serial);
+        unsigned int serial = last_serial + difference;
+        if((int)(serial - last_serial) > 0) last_serial = serial;
+        return serial;
+    }
+
+    int WireDecoder::decodeMIDIPacket(const unsigned char* buffer, int size, double local_now, double remote_now, Packet_MIDIMessageJournal& packet) {
+        int used;
+        return decodeMIDIPacket(buffer, size, local_now, remote_now, packet, used);
+    }
+
+    int WireDecoder::decodeMIDIPacket(const unsigned char* buffer, int size, double local_now, double remote_now, Packet_MIDIMessageJournal& packet, int& used) {
+        Reader in(buffer, size);
+        unsigned int type = in.byte();
+        if(!isWireMIDI(type)) return 0;
+        memset(&packet, 0, sizeof(packet));
+        Packet_MIDIMessage& data = packet.data.data;
+        data.type = PACKET_MIDIMessage;
+        int decoded_size = sizeof(Packet_MIDIMessage);
+
+        unsigned int session = in.u16();
+        unsigned int serial = in.u16();
+        boost::uint32_t timestamp = in.u24();
+        int length = (type & WIRE_FLAG_LENGTH) ? in.byte() : impliedLength(in.peek());
+        if(length < 1 || length > MIDI_MAX_MESSAGE_SIZE) return 0;
+        in.bytes(data.message.message, length);
+        data.message.length = length;
+        data.message.timestamp = unwrap24(timestamp, toMicroseconds(remote_now)) / 1e6;
+
+        if(type & WIRE_FLAG_ECHO) {
+            packet.data.echo_timestamp = unwrap32(in.u32(), toMicroseconds(local_now)) / 1e6;
+            packet.data.echo_hold = in.svarint() / 1e6;
+            data.type = PACKET_MIDIMessageEcho;
+            decoded_size = sizeof(Packet_MIDIMessageEcho);
+        }
+        // Serial deltas for now, made absolute once the serial is known.
+        unsigned int count = 0;
+        if(type & WIRE_FLAG_JOURNAL) {
+            count = in.byte();
+            if(count > (unsigned int)JOURNAL_MAX_SIZE) return 0;
+            for(unsigned int i = 0; i < count; i++) {
+                JournalEntry& entry = packet.entries[i];
+                entry.serial = (unsigned int)in.varint();
+                entry.age = (float)(in.varint() / 1e6);
+                int entry_length = impliedLength(in.peek());
+                if(entry_length < 1 || entry_length > 3) return 0;
+                entry.length = (unsigned char)entry_length;
+                in.bytes(entry.message, entry_length);
+            }
+            packet.count = count;
+            data.type = PACKET_MIDIMessageJournal;
+            decoded_size = (int)(sizeof(Packet_MIDIMessageJournal) - sizeof(JournalEntry) * (JOURNAL_MAX_SIZE - count));
+        }
+        if(!in.ok) return 0;
+
+        data.identifier.session = session;
+        data.identifier.serial = extendSerial(session, serial);
+        data.identifier.timestamp = data.message.timestamp;
+        for(unsigned int i = 0; i < count; i++) {
+            packet.entries[i].serial = data.identifier.serial - packet.entries[i].serial;
+        }
+        used = in.position;
+        return decoded_size;
+    }
+
+    bool WireDecoder::decodeParity(const unsigned char* buffer, int size, Packet_Parity& parity) {
+        Reader in(buffer, size);
+        if(in.byte() != WIRE_V1_PARITY) return false;
+        memset(&parity, 0, sizeof(parity));
+        parity.type = PACKET_Parity;
+        parity.count = (unsigned char)in.byte();
+        unsigned int session = in.u16();
+        unsigned int first_serial = in.u16();
+        in.bytes(parity.parity, MIDI_RECORD_SIZE);
+        if(!in.ok) return false;
+        parity.session = session;
+        parity.first_serial = extendSerial(session, first_serial);
+        return true;
+    }
+
+    int WireDecoder::decodeBundle(const unsigned char* buffer, int size, double local_now, double remote_now,
+                                  Packet_MIDIMessageJournal& first, int& first_size, Packet_MIDIMessage* rest, int max_rest) {
+        if(size < 2 || buffer[0] != WIRE_V1_BUNDLE) return -1;
+        int count = buffer[1];
+        if(count > max_rest) return -1;
+        int used;
+        first_size = decodeMIDIPacket(buffer + 2, size - 2, local_now, remote_now, first, used);
+        if(first_size == 0) return -1;
+
+        Reader in(buffer + 2 + used, size - 2 - used);
+        const Packet_MIDIMessage& head = first.data.data;
+        boost::int64_t timestamp = toMicroseconds(head.message.timestamp);
+        for(int i = 0; i < count; i++) {
+            Packet_MIDIMessage& packet = rest[i];
+            memset(&packet, 0, sizeof(packet));
+            packet.type = PACKET_MIDIMessage;
+            boost::uint64_t header = in.varint();
+            timestamp += unzigzag(header >> 1);
+            int length = (header & 1) ? in.byte() : impliedLength(in.peek());
+            if(length < 1 || length > MIDI_MAX_MESSAGE_SIZE) return -1;
+            in.bytes(packet.message.message, length);
+            packet.message.length = length;
+            packet.message.timestamp = timestamp / 1e6;
+            packet.identifier.session = head.identifier.session;
+            packet.identifier.serial = head.identifier.serial + i + 1;
+            packet.identifier.timestamp = packet.message.timestamp;
+        }
+        if(!in.ok) return -1;
+        extendSerial(head.identifier.session, (head.identifier.serial + count) & 0xFFFF);
+        return count;
+    }
+
+    MessageBundler::MessageBundler(double window_) {
+        window = window_;
+        bundle_size = 0;
+        count = 0;
+        last_timestamp = 0;
+        last_serial = 0;
+        last_sent = -1e300;
+        held_until = DEADLINE_NONE;
+        num_messages = 0;
+        num_datagrams = 0;
+    }
+
+    void MessageBundler::setWindow(double window_) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        window = window_;
+    }
+
+    bool MessageBundler::add(double now, const Packet_MIDIMessageJournal& packet, unsigned char* datagram, int& size) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        const Packet_MIDIMessage& data = packet.data.data;
+        num_messages += 1;
+        if(count == 0 && now - last_sent >= window) {
+            // Nothing went out lately, a lone message isn't held back.
+            size = encodeMIDIPacket(packet, datagram);
+            last_sent = now;
+            num_datagrams += 1;
+            return true;
+        }
+        bool ready = false;
+        if(count > 0) {
+            boost::int64_t timestamp = toMicroseconds(data.message.timestamp);
+            int length = clampLength(data.message.length);
+            bool explicit_length = length == 0 || impliedLength(data.message.message[0]) != length;
+            unsigned char message[WIRE_MAX_SIZE];
+            Writer out(message);
+            out.varint((zigzag(timestamp - last_timestamp) << 1) | (explicit_length ? 1 : 0));
+            if(explicit_length) out.byte(length);
+            out.bytes(data.message.message, length);
+            if(data.identifier.serial == last_serial + 1 && count < WIRE_MAX_BUNDLE && bundle_size + out.size <= WIRE_BUNDLE_MAX_SIZE) {
+                memcpy(bundle + bundle_size, message, out.size);
+                bundle_size += out.size;
+                count += 1;
+                last_timestamp = timestamp;
+                last_serial = data.identifier.serial;
+                return false;
+            }
+            // Full: what is held goes now, this message starts the next bundle.
+            take(now, datagram, size);
+            ready = true;
+        }
+        // Held, so its timestamp won't be its send time: no echo on it.
+        Packet_MIDIMessageJournal head = packet;
+        if(head.data.data.type == PACKET_MIDIMessageEcho) head.data.data.type = PACKET_MIDIMessage;
+        head.data.echo_timestamp = 0;
+        head.data.echo_hold = 0;
+        bundle[0] = WIRE_V1_BUNDLE;
+        bundle[1] = 0;
+        bundle_size = 2 + encodeMIDIPacket(head, bundle + 2);
+        count = 1;
+        last_timestamp = toMicroseconds(data.message.timestamp);
+        last_serial = data.identifier.serial;
+        held_until = last_sent + window;
+        return ready;
+    }
+
+    bool MessageBundler::flush(double now, unsigned char* datagram, int& size) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        if(count == 0 || now < held_until) return false;
+        take(now, datagram, size);
+        return true;
+    }
+
+    bool MessageBundler::drain(double now, unsigned char* datagram, int& size) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        if(count == 0) return false;
+        take(now, datagram, size);
+        return true;
+    }
+
+    double MessageBundler::deadline() {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        return count > 0 ? held_until : DEADLINE_NONE;
+    }
+
+    void MessageBundler::statistics(int& messages, int& datagrams) {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        messages = num_messages;
+        datagrams = num_datagrams;
+    }
+
+    void MessageBundler::take(double now, unsigned char* datagram, int& size) {
+        // Even a bundle of one, so the receiver knows it was held.
+        bundle[1] = (unsigned char)(count - 1);
+        size = bundle_size;
+        memcpy(datagram, bundle, size);
+        count = 0;
+        bundle_size = 0;
+        held_until = DEADLINE_NONE;
+        last_sent = now;
+        num_datagrams += 1;
+    }
+
+}
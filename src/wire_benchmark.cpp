@@ -0,0 +1,170 @@
+// Wire format benchmark: encoded size and encode/decode time per packet,
+// checking every packet survives the round trip.
+
+#include "wire.h"
+#include "timer.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+using namespace PianoConnect;
+using namespace std;
+
+const int NUM_PACKETS = 1000000;
+
+Packet_MIDIMessageJournal makePacket(int i, unsigned char type, double t) {
+    Packet_MIDIMessageJournal packet;
+    memset(&packet, 0, sizeof(packet));
+    Packet_MIDIMessage& data = packet.data.data;
+    data.type = type;
+    data.message.length = 3;
+    data.message.timestamp = t;
+    data.message.message[0] = (i & 1) ? 0x80 : 0x90;
+    data.message.message[1] = 60 + i % 12;
+    data.message.message[2] = 64;
+    data.identifier.serial = i;
+    data.identifier.session = 42;
+    data.identifier.timestamp = t;
+    if(type != PACKET_MIDIMessage) {
+        packet.data.echo_timestamp = t - 0.015;
+        packet.data.echo_hold = 0.0042;
+    }
+    if(type == PACKET_MIDIMessageJournal) {
+        packet.count = 4;
+        for(int j = 0; j < 4; j++) {
+            JournalEntry& entry = packet.entries[j];
+            entry.serial = i - 4 + j;
+            entry.age = 0.05f * (4 - j);
+            entry.length = 3;
+            entry.message[0] = 0xB0;
+            entry.message[1] = 64;
+            entry.message[2] = j * 30;
+        }
+    }
+    return packet;
+}
+
+bool same(const Packet_MIDIMessageJournal& a, const Packet_MIDIMessageJournal& b) {
+    const Packet_MIDIMessage& x = a.data.data;
+    const Packet_MIDIMessage& y = b.data.data;
+    if(x.type != y.type || x.message.length != y.message.length) return false;
+    if(memcmp(x.message.message, y.message.message, x.message.length) != 0) return false;
+    if(fabs(x.message.timestamp - y.message.timestamp) > 1e-6) return false;
+    if(x.identifier.serial != y.identifier.serial || x.identifier.session != y.identifier.session) return false;
+    if(x.type == PACKET_MIDIMessage) return true;
+    if(fabs(a.data.echo_timestamp - b.data.echo_timestamp) > 1e-6 || fabs(a.data.echo_hold - b.data.echo_hold) > 1e-6) return false;
+    if(x.type == PACKET_MIDIMessageEcho) return true;
+    if(a.count != b.count) return false;
+    for(unsigned int j = 0; j < a.count; j++) {
+        if(a.entries[j].serial != b.entries[j].serial || fabs(a.entries[j].age - b.entries[j].age) > 1e-5) return false;
+        if(memcmp(a.entries[j].message, b.entries[j].message, a.entries[j].length) != 0) return false;
+    }
+    return true;
+}
+
+const int BATCH = 1000;
+
+void run(const char* name, unsigned char type, size_t raw_size) {
+    // Days into the sender's clock, so timestamps wrap modulo 2^32us.
+    double start = 250000.0;
+    static Packet_MIDIMessageJournal packets[BATCH], decoded[BATCH];
+    static unsigned char buffers[BATCH][WIRE_MAX_SIZE];
+    int sizes[BATCH], decoded_sizes[BATCH];
+    WireDecoder decoder;
+    long bytes = 0;
+    int errors = 0;
+    double encode = 0, decode = 0;
+    for(int b = 0; b < NUM_PACKETS / BATCH; b++) {
+        for(int i = 0; i < BATCH; i++) {
+            int n = b * BATCH + i;
+            packets[i] = makePacket(n, type, start + n * 0.01);
+        }
+        double t0 = precise_time();
+        for(int i = 0; i < BATCH; i++) sizes[i] = encodeMIDIPacket(packets[i], buffers[i]);
+        double t1 = precise_time();
+        // Received when sent, the receiver's idea of the sender clock a little off.
+        for(int i = 0; i < BATCH; i++) {
+            double t = start + (b * BATCH + i) * 0.01;
+            decoded_sizes[i] = decoder.decodeMIDIPacket(buffers[i], sizes[i], t + 3.0, t + 0.2, decoded[i]);
+        }
+        double t2 = precise_time();
+        encode += t1 - t0;
+        decode += t2 - t1;
+        for(int i = 0; i < BATCH; i++) {
+            bytes += sizes[i];
+            if(decoded_sizes[i] == 0 || !same(packets[i], decoded[i])) errors += 1;
+        }
+    }
+    cout << name << ": " << (double)bytes / NUM_PACKETS << " bytes (raw struct " << raw_size << "), "
+         << encode / NUM_PACKETS * 1e9 << " ns encode, " << decode / NUM_PACKETS * 1e9 << " ns decode, "
+         << errors << " errors" << endl;
+}
+
+int main() {
+    run("note", PACKET_MIDIMessage, sizeof(Packet_MIDIMessage));
+    run("note + echo", PACKET_MIDIMessageEcho, sizeof(Packet_MIDIMessageEcho));
+    run("note + echo + journal of 4", PACKET_MIDIMessageJournal, sizeof(Packet_MIDIMessageJournal) - sizeof(JournalEntry) * (JOURNAL_MAX_SIZE - 4));
+
+    // Chords of 10 notes 100us apart, bundled with a 1ms window.
+    {
+        const int CHORD_SIZE = 10;
+        const int NUM_CHORDS = 10000;
+        MessageBundler bundler(0.001);
+        WireDecoder decoder;
+        unsigned char datagram[WIRE_BUNDLE_MAX_SIZE];
+        Packet_MIDIMessageJournal first;
+        Packet_MIDIMessage rest[WIRE_MAX_BUNDLE];
+        long bytes = 0;
+        int datagrams = 0, received = 0, errors = 0;
+        for(int c = 0; c < NUM_CHORDS; c++) {
+            double t = 250000.0 + c * 0.5;
+            for(int i = 0; i <= CHORD_SIZE; i++) {
+                int size;
+                bool ready;
+                if(i < CHORD_SIZE) {
+                    int n = c * CHORD_SIZE + i;
+                    ready = bundler.add(t + i * 1e-4, makePacket(n, PACKET_MIDIMessage, t + i * 1e-4), datagram, size);
+                } else {
+                    // The playback thread's flush once the window has closed.
+                    ready = bundler.flush(bundler.deadline(), datagram, size);
+                }
+                if(!ready) continue;
+                bytes += size;
+                datagrams += 1;
+                int first_size = 0, count = 0;
+                if(datagram[0] == WIRE_V1_BUNDLE) {
+                    count = decoder.decodeBundle(datagram, size, t, t, first, first_size, rest, WIRE_MAX_BUNDLE);
+                } else {
+                    first_size = decoder.decodeMIDIPacket(datagram, size, t, t, first);
+                }
+                if(first_size == 0 || count < 0) {
+                    errors += 1;
+                    continue;
+                }
+                for(int j = -1; j < count; j++) {
+                    const Packet_MIDIMessage& p = j < 0 ? first.data.data : rest[j];
+                    Packet_MIDIMessageJournal expected = makePacket(p.identifier.serial, PACKET_MIDIMessage, 0);
+                    double timestamp = t + (p.identifier.serial - c * CHORD_SIZE) * 1e-4;
+                    if(memcmp(p.message.message, expected.data.data.message.message, 3) != 0 || fabs(p.message.timestamp - timestamp) > 1e-6) errors += 1;
+                    received += 1;
+                }
+            }
+        }
+        cout << "chord of " << CHORD_SIZE << ", bundled: " << (double)bytes / NUM_CHORDS << " bytes in "
+             << (double)datagrams / NUM_CHORDS << " datagrams, " << received << " of " << NUM_CHORDS * CHORD_SIZE
+             << " received, " << errors << " errors" << endl;
+    }
+
+    // Parity records.
+    int errors = 0;
+    for(int i = 0; i < NUM_PACKETS; i++) {
+        MIDIMessage message = makePacket(i, PACKET_MIDIMessage, 250000.0 + i * 0.01).data.data.message, back;
+        unsigned char record[MIDI_RECORD_SIZE];
+        encodeRecord(message, record);
+        decodeRecord(record, back);
+        if(back.length != message.length || memcmp(back.message, message.message, 3) != 0 || fabs(back.timestamp - message.timestamp) > 1e-6) errors += 1;
+    }
+    cout << "parity record: " << MIDI_RECORD_SIZE << " bytes, " << errors << " errors" << endl;
+}